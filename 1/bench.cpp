@@ -0,0 +1,315 @@
+#include "libcoro.h"
+
+#include "corobus.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+/*
+ * Load benchmark of the bus. Each run moves a number of messages
+ * through a topology of producers and consumers and prints one
+ * JSON object per line:
+ *
+ *   {"topology":"1:1","size":16,"api":"batch","messages":...,
+ *    "msgs_per_sec":...,"switches_per_msg":...,
+ *    "p50_ns":...,"p99_ns":...}
+ *
+ * "messages" is the number of received messages, so a broadcast
+ * to K channels counts each message K times. There is no batch
+ * broadcast, so its batch runs batch only the receive side and
+ * are labeled "batch_recv". The latency is the
+ * time from the send call start to the recv call return, also
+ * called the handoff latency.
+ *
+ * Usage: ./bench [--messages N] [--quick]
+ */
+
+enum {
+	BENCH_FAN = 4,
+	BENCH_BATCH = 64,
+};
+
+enum bench_topology {
+	BENCH_TOPOLOGY_ONE_TO_ONE,
+	BENCH_TOPOLOGY_MANY_TO_ONE,
+	BENCH_TOPOLOGY_ONE_TO_MANY,
+	BENCH_TOPOLOGY_BROADCAST,
+};
+
+static const char *bench_topology_str[] = {
+	"1:1",
+	"N:1",
+	"1:N",
+	"broadcast",
+};
+
+/** How the messages of the run are sent and received. */
+static const char *
+bench_api_str(enum bench_topology topology, bool is_batch)
+{
+	if (!is_batch)
+		return "scalar";
+	return topology == BENCH_TOPOLOGY_BROADCAST ? "batch_recv" : "batch";
+}
+
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * State of one channel in a benchmark run, shared by all its
+ * producers and consumers.
+ */
+struct bench_run {
+	struct coro_bus *bus;
+	bool is_batch;
+	/** Send time of each message, indexed by the message. */
+	uint64_t *send_time;
+	/** Handoff latency of each received message. */
+	std::vector<uint64_t> latencies;
+	/** Received in total by all consumers of the channel. */
+	unsigned received;
+	/** The last producer to finish closes the channel. */
+	int producers_left;
+	int channel;
+};
+
+struct bench_producer {
+	/** A broadcast producer sends to all of the runs. */
+	struct bench_run *runs;
+	int run_count;
+	unsigned first;
+	unsigned last;
+};
+
+struct bench_consumer {
+	struct bench_run *run;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_producer *ctx = (decltype(ctx))arg;
+	struct bench_run *run = &ctx->runs[0];
+	unsigned next = ctx->first;
+	unsigned batch[BENCH_BATCH];
+	while (next < ctx->last) {
+		if (!run->is_batch) {
+			run->send_time[next] = bench_now_ns();
+			if (coro_bus_send(run->bus, run->channel, next) != 0)
+				abort();
+			++next;
+			continue;
+		}
+		unsigned count = std::min<unsigned>(BENCH_BATCH, ctx->last - next);
+		uint64_t now = bench_now_ns();
+		for (unsigned i = 0; i < count; ++i) {
+			batch[i] = next + i;
+			run->send_time[next + i] = now;
+		}
+		int rc = coro_bus_send_v(run->bus, run->channel, batch, count);
+		if (rc <= 0)
+			abort();
+		next += rc;
+	}
+	if (--run->producers_left == 0)
+		coro_bus_channel_close_write(run->bus, run->channel);
+	return NULL;
+}
+
+static void *
+bench_broadcaster_f(void *arg)
+{
+	struct bench_producer *ctx = (decltype(ctx))arg;
+	struct bench_run *run = &ctx->runs[0];
+	for (unsigned next = ctx->first; next < ctx->last; ++next) {
+		run->send_time[next] = bench_now_ns();
+		if (coro_bus_broadcast(run->bus, next) != 0)
+			abort();
+	}
+	for (int i = 0; i < ctx->run_count; ++i)
+		coro_bus_channel_close_write(run->bus, ctx->runs[i].channel);
+	return NULL;
+}
+
+/** Receive until the producers close the channel and it is drained. */
+static void *
+bench_consumer_f(void *arg)
+{
+	struct bench_consumer *ctx = (decltype(ctx))arg;
+	struct bench_run *run = ctx->run;
+	unsigned batch[BENCH_BATCH];
+	while (true) {
+		int rc;
+		if (run->is_batch)
+			rc = coro_bus_recv_v(run->bus, run->channel, batch, BENCH_BATCH);
+		else
+			rc = coro_bus_recv(run->bus, run->channel, batch);
+		if (rc < 0) {
+			if (coro_bus_errno() != CORO_BUS_ERR_EOF)
+				abort();
+			break;
+		}
+		if (!run->is_batch)
+			rc = 1;
+		uint64_t now = bench_now_ns();
+		for (int i = 0; i < rc; ++i)
+			run->latencies.push_back(now - run->send_time[batch[i]]);
+		run->received += rc;
+	}
+	return NULL;
+}
+
+static uint64_t
+bench_percentile(std::vector<uint64_t> &values, double p)
+{
+	if (values.empty())
+		return 0;
+	size_t idx = (size_t)(p * (values.size() - 1));
+	std::nth_element(values.begin(), values.begin() + idx, values.end());
+	return values[idx];
+}
+
+static void
+bench_run_one(enum bench_topology topology, size_t size, bool is_batch,
+	unsigned message_count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	std::vector<uint64_t> send_time(message_count);
+	int producer_count = 1;
+	int consumer_count = 1;
+	int channel_count = 1;
+	if (topology == BENCH_TOPOLOGY_MANY_TO_ONE)
+		producer_count = BENCH_FAN;
+	else if (topology == BENCH_TOPOLOGY_ONE_TO_MANY)
+		consumer_count = BENCH_FAN;
+	else if (topology == BENCH_TOPOLOGY_BROADCAST)
+		consumer_count = channel_count = BENCH_FAN;
+
+	/* Each broadcast channel has to deliver all the messages. */
+	struct bench_run runs[BENCH_FAN];
+	for (int i = 0; i < channel_count; ++i) {
+		struct bench_run *run = &runs[i];
+		run->bus = bus;
+		run->is_batch = is_batch;
+		run->send_time = send_time.data();
+		run->latencies.reserve(message_count);
+		run->received = 0;
+		run->producers_left = topology == BENCH_TOPOLOGY_BROADCAST ?
+			0 : producer_count;
+		run->channel = coro_bus_channel_open(bus, size);
+		if (run->channel < 0)
+			abort();
+	}
+	struct bench_producer producers[BENCH_FAN];
+	struct bench_consumer consumers[BENCH_FAN];
+	struct coro *producer_coros[BENCH_FAN];
+	struct coro *consumer_coros[BENCH_FAN];
+
+	unsigned long long switches = coro_switch_count();
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < consumer_count; ++i) {
+		struct bench_consumer *c = &consumers[i];
+		c->run = &runs[i % channel_count];
+		consumer_coros[i] = coro_new(bench_consumer_f, c);
+	}
+	for (int i = 0; i < producer_count; ++i) {
+		struct bench_producer *p = &producers[i];
+		p->runs = runs;
+		p->run_count = channel_count;
+		p->first = (uint64_t)message_count * i / producer_count;
+		p->last = (uint64_t)message_count * (i + 1) / producer_count;
+		coro_f f = topology == BENCH_TOPOLOGY_BROADCAST ?
+			bench_broadcaster_f : bench_producer_f;
+		producer_coros[i] = coro_new(f, p);
+	}
+	for (int i = 0; i < producer_count; ++i)
+		coro_join(producer_coros[i]);
+	for (int i = 0; i < consumer_count; ++i)
+		coro_join(consumer_coros[i]);
+	uint64_t duration = bench_now_ns() - start;
+	switches = coro_switch_count() - switches;
+
+	unsigned long long received = 0;
+	std::vector<uint64_t> &latencies = runs[0].latencies;
+	for (int i = 0; i < channel_count; ++i) {
+		received += runs[i].received;
+		if (i > 0) {
+			latencies.insert(latencies.end(),
+				runs[i].latencies.begin(), runs[i].latencies.end());
+		}
+	}
+	for (int i = 0; i < channel_count; ++i)
+		coro_bus_channel_close(bus, runs[i].channel);
+	uint64_t p50 = bench_percentile(latencies, 0.5);
+	uint64_t p99 = bench_percentile(latencies, 0.99);
+	printf("{\"topology\":\"%s\",\"size\":%zu,\"api\":\"%s\","
+		"\"messages\":%llu,\"msgs_per_sec\":%.0f,"
+		"\"switches_per_msg\":%.3f,\"p50_ns\":%llu,\"p99_ns\":%llu}\n",
+		bench_topology_str[topology], size, bench_api_str(topology, is_batch),
+		received,
+		received * 1e9 / duration, (double)switches / received,
+		(unsigned long long)p50, (unsigned long long)p99);
+	fflush(stdout);
+	coro_bus_delete(bus);
+}
+
+struct bench_config {
+	unsigned message_count;
+	bool is_quick;
+};
+
+static void *
+bench_main_f(void *arg)
+{
+	struct bench_config *cfg = (decltype(cfg))arg;
+	const size_t sizes[] = {1, 16, 256, 4096, 65536};
+	const size_t quick_sizes[] = {1, 256};
+	const size_t *size_list = cfg->is_quick ? quick_sizes : sizes;
+	size_t size_count = cfg->is_quick ?
+		sizeof(quick_sizes) / sizeof(quick_sizes[0]) :
+		sizeof(sizes) / sizeof(sizes[0]);
+	for (int t = BENCH_TOPOLOGY_ONE_TO_ONE; t <= BENCH_TOPOLOGY_BROADCAST; ++t) {
+		for (size_t i = 0; i < size_count; ++i) {
+			bench_run_one((enum bench_topology)t, size_list[i], false,
+				cfg->message_count);
+			bench_run_one((enum bench_topology)t, size_list[i], true,
+				cfg->message_count);
+		}
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_config cfg;
+	cfg.message_count = 200000;
+	cfg.is_quick = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+			cfg.message_count = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--quick") == 0) {
+			cfg.is_quick = true;
+		} else {
+			fprintf(stderr, "Usage: %s [--messages N] [--quick]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, &cfg);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
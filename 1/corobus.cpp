@@ -4,8 +4,39 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#define CORO_BUS_HAS_SHARED 1
+#else
+#define CORO_BUS_HAS_SHARED 0
+#endif
+
+struct coro_bus_channel;
+
+/**
+ * A free slot in a channel kept for a broadcast which still waits
+ * for space in other channels. Nobody else can take the slot.
+ */
+struct slot_reservation {
+	/** Link in the list of reservations of the channel. */
+	struct rlist in_channel;
+	/** Link in the list of reservations of the broadcast. */
+	struct rlist in_owner;
+	/** The channel, or NULL if it was closed. */
+	struct coro_bus_channel *ch;
+};
 
 /**
  * One coroutine waiting to be woken up in a list of other
@@ -15,39 +46,164 @@ struct wakeup_entry {
 	struct rlist base;
 	struct coro *coro;
 	bool already_removed;
+	/**
+	 * Messages to send or a buffer to receive into. The waker
+	 * moves the messages on behalf of the waiter before waking
+	 * it up, so a woken waiter never has to compete for the
+	 * channel again.
+	 */
+	unsigned *data;
+	/** Size of @a data. */
+	unsigned count;
+	/**
+	 * How many messages the wakers have moved. A batch waiter
+	 * stays first in the queue until it is full or runs, so it
+	 * gets everything the channel could give it meanwhile.
+	 */
+	unsigned done;
+	/**
+	 * A broadcast can't send anything until all the channels
+	 * have space. The waker reserves a slot for it instead of
+	 * moving the data.
+	 */
+	struct slot_reservation *reservation;
+	/**
+	 * Set when the waiter is released without being served,
+	 * because the channel was closed.
+	 */
+	enum coro_bus_error_code error;
 };
 
+static void
+wakeup_entry_create(struct wakeup_entry *entry, unsigned *data,
+	unsigned count, struct slot_reservation *reservation)
+{
+	entry->coro = coro_this();
+	entry->already_removed = false;
+	entry->data = data;
+	entry->count = count;
+	entry->done = 0;
+	entry->reservation = reservation;
+	entry->error = CORO_BUS_ERR_NONE;
+}
+
 /** A queue of suspended coros waiting to be woken up. */
 struct wakeup_queue {
 	struct rlist coros;
 };
 
-/** Suspend the current coroutine until it is woken up. */
-static void
-wakeup_queue_suspend_this(struct wakeup_queue *queue)
+/** Deadline of the calls which wait without a timeout. */
+#define DEADLINE_INFINITY HUGE_VAL
+
+static inline bool
+deadline_is_passed(double deadline)
 {
-	struct wakeup_entry entry;
-	entry.coro = coro_this();
-	entry.already_removed = false;
-	rlist_add_tail_entry(&queue->coros, &entry, base);
-	coro_suspend();
-	if (!entry.already_removed)
-		rlist_del_entry(&entry, base);
+	return deadline != DEADLINE_INFINITY && coro_clock() >= deadline;
 }
 
-/** Wakeup the first coroutine in the queue. */
+/**
+ * Suspend the current coroutine until it is woken up or the
+ * deadline passes. If not woken up by the queue, the entry
+ * unlinks itself - it is a list node, so that is O(1) regardless
+ * of how many coroutines wait in the queue.
+ */
 static void
-wakeup_queue_wakeup_first(struct wakeup_queue *queue)
+wakeup_queue_suspend_this(struct wakeup_queue *queue,
+	struct wakeup_entry *entry, double deadline)
+{
+	rlist_add_tail_entry(&queue->coros, entry, base);
+	if (deadline == DEADLINE_INFINITY)
+		coro_suspend();
+	else
+		coro_suspend_timeout(deadline - coro_clock());
+	if (!entry->already_removed)
+		rlist_del_entry(entry, base);
+}
+
+static inline struct wakeup_entry *
+wakeup_queue_first(struct wakeup_queue *queue)
 {
 	if (rlist_empty(&queue->coros))
-		return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-		struct wakeup_entry, base);
-	entry->already_removed = true;
-	rlist_del_entry(entry, base);
-	coro_wakeup(entry->coro);
+		return NULL;
+	return rlist_first_entry(&queue->coros, struct wakeup_entry, base);
+}
+
+/**
+ * Wake up all the coroutines of the queue with the given error.
+ * The queue is detached at once, so the waiters don't touch it
+ * anymore and the channel can be freed right away.
+ */
+static void
+wakeup_queue_release_all(struct wakeup_queue *queue,
+	enum coro_bus_error_code error)
+{
+	struct rlist coros;
+	rlist_create(&coros);
+	rlist_splice(&coros, &queue->coros);
+	struct wakeup_entry *entry;
+	rlist_foreach_entry(entry, &coros, base) {
+		entry->already_removed = true;
+		entry->error = error;
+		coro_wakeup(entry->coro);
+	}
+}
+
+/**
+ * Account the messages moved on behalf of the first waiter. It is
+ * woken up on the first progress, and leaves the queue once there
+ * is nothing more to move for it.
+ */
+static void
+wakeup_queue_progress_first(struct wakeup_queue *queue, unsigned moved)
+{
+	struct wakeup_entry *entry = wakeup_queue_first(queue);
+	bool was_idle = entry->done == 0;
+	entry->done += moved;
+	if (entry->done >= entry->count) {
+		entry->already_removed = true;
+		rlist_del_entry(entry, base);
+	}
+	if (was_idle)
+		coro_wakeup(entry->coro);
 }
 
+enum {
+	/** "CBUS" - tells a shared channel region from garbage. */
+	CORO_BUS_SHM_MAGIC = 0x53554243,
+	CORO_BUS_CACHE_LINE = 64,
+	/**
+	 * Set in the tail when the channel is closed for writing.
+	 * The tail is what the receivers sleep on, so they notice.
+	 * The sender advances the tail with a CAS which fails once
+	 * the flag is set, so nothing is sent after the close.
+	 */
+	CORO_BUS_SHM_CLOSED = 0x80000000,
+};
+
+/**
+ * Header of a shared memory channel. It is in the beginning of
+ * the region and is followed by the messages. Positions run in
+ * [0, 2 * size_limit), so a full ring can be told from an empty
+ * one for any size limit, and a position changes on each message
+ * which makes it usable as a futex. The receiver owns the head,
+ * the sender owns the tail. Each of them is on its own cache line
+ * together with the counter of the opposite side sleepers, which
+ * is checked right after the position is updated.
+ */
+struct alignas(CORO_BUS_CACHE_LINE) coro_bus_shm {
+	uint32_t magic;
+	/** Channel max capacity. */
+	uint32_t size_limit;
+	/** Position of the next message to receive. */
+	alignas(CORO_BUS_CACHE_LINE) uint32_t head;
+	/** How many senders sleep on the head futex. */
+	uint32_t send_waiters;
+	/** Position where the next message is sent. */
+	alignas(CORO_BUS_CACHE_LINE) uint32_t tail;
+	/** How many receivers sleep on the tail futex. */
+	uint32_t recv_waiters;
+};
+
 struct coro_bus_channel {
 	/** Channel max capacity. */
 	size_t size_limit;
@@ -55,12 +211,24 @@ struct coro_bus_channel {
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
-	/** Message queue. */
+	/** Message queue. Not used by shared channels. */
 	unsigned *data;
 	/** Current number of messages in the queue. */
 	size_t data_count;
 	/** Index of the first message (head pointer). */
 	size_t data_head;
+	/** Free slots reserved for waiting broadcasts. */
+	size_t send_reserved;
+	/** Reservations of the free slots, for the close to clear. */
+	struct rlist reservations;
+	/** Closed for writing. Shared channels keep it in the tail. */
+	bool is_write_closed;
+	/** Shared memory ring, or NULL for a process-local channel. */
+	struct coro_bus_shm *shm;
+	/** Size of the shared memory mapping. */
+	size_t shm_size;
+	/** File descriptor of the shared memory. */
+	int shm_fd;
 };
 
 struct coro_bus {
@@ -69,6 +237,417 @@ struct coro_bus {
 	int channel_capacity;
 };
 
+#if CORO_BUS_HAS_SHARED
+
+static int
+futex_wait(uint32_t *futex, uint32_t val, double deadline)
+{
+	struct timespec ts;
+	struct timespec *timeout = NULL;
+	if (deadline != DEADLINE_INFINITY) {
+		double left = deadline - coro_clock();
+		if (left <= 0)
+			return 0;
+		ts.tv_sec = (time_t)left;
+		ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+		timeout = &ts;
+	}
+	return syscall(SYS_futex, futex, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif
+
+static inline unsigned *
+shm_slot(struct coro_bus_shm *shm, uint32_t pos)
+{
+	if (pos >= shm->size_limit)
+		pos -= shm->size_limit;
+	return (unsigned *)(shm + 1) + pos;
+}
+
+static inline uint32_t
+shm_advance(const struct coro_bus_shm *shm, uint32_t pos, uint32_t step)
+{
+	pos += step;
+	if (pos >= 2 * shm->size_limit)
+		pos -= 2 * shm->size_limit;
+	return pos;
+}
+
+static inline uint32_t
+shm_count(const struct coro_bus_shm *shm, uint32_t head, uint32_t tail)
+{
+	if (tail >= head)
+		return tail - head;
+	return tail + 2 * shm->size_limit - head;
+}
+
+/** How many messages are stored in the channel. */
+static size_t
+channel_size(const struct coro_bus_channel *ch)
+{
+	if (ch->shm == NULL)
+		return ch->data_count;
+	uint32_t head = __atomic_load_n(&ch->shm->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = __atomic_load_n(&ch->shm->tail, __ATOMIC_ACQUIRE);
+	return shm_count(ch->shm, head, tail & ~CORO_BUS_SHM_CLOSED);
+}
+
+static inline bool
+channel_is_write_closed(const struct coro_bus_channel *ch)
+{
+	if (ch->shm == NULL)
+		return ch->is_write_closed;
+	uint32_t tail = __atomic_load_n(&ch->shm->tail, __ATOMIC_ACQUIRE);
+	return (tail & CORO_BUS_SHM_CLOSED) != 0;
+}
+
+/** How many messages can be sent without waiting. */
+static size_t
+channel_space(const struct coro_bus_channel *ch)
+{
+	return ch->size_limit - channel_size(ch) - ch->send_reserved;
+}
+
+static inline bool
+channel_is_full(const struct coro_bus_channel *ch)
+{
+	return channel_space(ch) == 0;
+}
+
+static inline bool
+channel_is_empty(const struct coro_bus_channel *ch)
+{
+	return channel_size(ch) == 0;
+}
+
+/**
+ * Append as many of the given messages as fit into the channel.
+ * Local waiters are not woken up, but the peer process is. The
+ * channel must be open for writing, but a shared one can still be
+ * closed by the peer process meanwhile. Then nothing is sent.
+ */
+static unsigned
+channel_push_v(struct coro_bus_channel *ch, const unsigned *data,
+	unsigned count)
+{
+	assert(ch->shm != NULL || !ch->is_write_closed);
+	size_t space = channel_space(ch);
+	if (count > space)
+		count = space;
+	if (count == 0)
+		return 0;
+	if (ch->shm == NULL) {
+		size_t tail = (ch->data_head + ch->data_count) % ch->size_limit;
+		size_t first = ch->size_limit - tail;
+		if (first > count)
+			first = count;
+		memcpy(ch->data + tail, data, first * sizeof(*data));
+		memcpy(ch->data, data + first, (count - first) * sizeof(*data));
+		ch->data_count += count;
+		return count;
+	}
+	struct coro_bus_shm *shm = ch->shm;
+	uint32_t tail = __atomic_load_n(&shm->tail, __ATOMIC_RELAXED);
+	uint32_t pos = tail & ~CORO_BUS_SHM_CLOSED;
+	for (unsigned i = 0; i < count; ++i)
+		*shm_slot(shm, shm_advance(shm, pos, i)) = data[i];
+	/*
+	 * The peer process can set the closed flag in between, and its
+	 * receivers might have got the EOF already. So the written
+	 * slots are dropped then. Only the flag can change the tail
+	 * under the sender, so the CAS fails at most once.
+	 */
+	pos = shm_advance(shm, pos, count);
+	do {
+		if ((tail & CORO_BUS_SHM_CLOSED) != 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&shm->tail, &tail, pos, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+#if CORO_BUS_HAS_SHARED
+	if (__atomic_load_n(&shm->recv_waiters, __ATOMIC_SEQ_CST) != 0)
+		futex_wake(&shm->tail);
+#endif
+	return count;
+}
+
+/**
+ * Take as many messages from the channel as fit into the given
+ * array. Local waiters are not woken up, but the peer process is.
+ */
+static unsigned
+channel_pop_v(struct coro_bus_channel *ch, unsigned *data, unsigned capacity)
+{
+	size_t size = channel_size(ch);
+	unsigned count = capacity;
+	if (count > size)
+		count = size;
+	if (count == 0)
+		return 0;
+	if (ch->shm == NULL) {
+		size_t first = ch->size_limit - ch->data_head;
+		if (first > count)
+			first = count;
+		memcpy(data, ch->data + ch->data_head, first * sizeof(*data));
+		memcpy(data + first, ch->data, (count - first) * sizeof(*data));
+		ch->data_head = (ch->data_head + count) % ch->size_limit;
+		ch->data_count -= count;
+		return count;
+	}
+	struct coro_bus_shm *shm = ch->shm;
+	uint32_t head = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < count; ++i)
+		data[i] = *shm_slot(shm, shm_advance(shm, head, i));
+	__atomic_store_n(&shm->head, shm_advance(shm, head, count),
+		__ATOMIC_SEQ_CST);
+#if CORO_BUS_HAS_SHARED
+	if (__atomic_load_n(&shm->send_waiters, __ATOMIC_SEQ_CST) != 0)
+		futex_wake(&shm->head);
+#endif
+	return count;
+}
+
+/**
+ * Wait until a shared channel might be changed. If there are
+ * other coroutines ready to run, they are given a chance first -
+ * the peer might be in this process. Otherwise the thread sleeps
+ * until the peer process moves the position this side waits for,
+ * but not past the timers of the sleeping coroutines.
+ */
+static void
+channel_wait_shared(struct coro_bus_channel *ch, bool is_send, double deadline)
+{
+	double timer = coro_sched_next_deadline();
+	/* An expired timer is fired by the scheduler. */
+	if (coro_sched_has_ready() || timer <= coro_clock()) {
+		coro_yield();
+		return;
+	}
+	if (timer < deadline)
+		deadline = timer;
+#if CORO_BUS_HAS_SHARED
+	struct coro_bus_shm *shm = ch->shm;
+	uint32_t *pos = is_send ? &shm->head : &shm->tail;
+	uint32_t *waiters = is_send ? &shm->send_waiters : &shm->recv_waiters;
+	__atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * Check again after announcing the waiter. Otherwise the
+	 * peer could make the change in between and not wake
+	 * anybody up.
+	 */
+	uint32_t seen = __atomic_load_n(pos, __ATOMIC_SEQ_CST);
+	bool is_blocked = is_send ? channel_is_full(ch) : channel_is_empty(ch);
+	if (is_blocked && !channel_is_write_closed(ch))
+		futex_wait(pos, seen, deadline);
+	__atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+#else
+	(void)ch;
+	(void)is_send;
+	(void)deadline;
+#endif
+}
+
+static void
+slot_reservation_take(struct slot_reservation *r, struct coro_bus_channel *ch)
+{
+	assert(channel_space(ch) > 0);
+	ch->send_reserved++;
+	r->ch = ch;
+	rlist_add_tail(&ch->reservations, &r->in_channel);
+}
+
+/**
+ * Serve the waiters while the channel can satisfy them. Messages
+ * are moved right into the buffers of the waiting receivers, and
+ * the waiting senders' messages are moved into the freed slots,
+ * in the order of waiting. A woken up coroutine finds its
+ * operation already done, so the slots and the messages can't be
+ * stolen by anybody calling send/recv in between.
+ */
+static void
+channel_handoff(struct coro_bus_channel *ch)
+{
+	while (true) {
+		struct wakeup_entry *entry = wakeup_queue_first(&ch->recv_queue);
+		if (entry != NULL && channel_size(ch) > 0) {
+			unsigned moved = channel_pop_v(ch,
+				entry->data + entry->done,
+				entry->count - entry->done);
+			wakeup_queue_progress_first(&ch->recv_queue, moved);
+			continue;
+		}
+		entry = wakeup_queue_first(&ch->send_queue);
+		if (entry != NULL && channel_space(ch) > 0) {
+			unsigned moved;
+			if (entry->reservation != NULL) {
+				slot_reservation_take(entry->reservation, ch);
+				moved = 1;
+			} else {
+				moved = channel_push_v(ch,
+					entry->data + entry->done,
+					entry->count - entry->done);
+			}
+			wakeup_queue_progress_first(&ch->send_queue, moved);
+			continue;
+		}
+		return;
+	}
+}
+
+/**
+ * Wait until a channel is not full anymore or the deadline. For
+ * local channels the messages of the entry are sent by whoever
+ * frees the space, check entry->done.
+ */
+static void
+channel_wait_send(struct coro_bus_channel *ch, struct wakeup_entry *entry,
+	double deadline)
+{
+	if (ch->shm != NULL)
+		channel_wait_shared(ch, true, deadline);
+	else
+		wakeup_queue_suspend_this(&ch->send_queue, entry, deadline);
+}
+
+/**
+ * Wait until a channel is not empty anymore or the deadline. For
+ * local channels the messages are received into the entry by
+ * whoever sends them, check entry->done.
+ */
+static void
+channel_wait_recv(struct coro_bus_channel *ch, struct wakeup_entry *entry,
+	double deadline)
+{
+	if (ch->shm != NULL)
+		channel_wait_shared(ch, false, deadline);
+	else
+		wakeup_queue_suspend_this(&ch->recv_queue, entry, deadline);
+}
+
+/**
+ * Send as many of the messages as fit and serve the waiters.
+ *
+ * @retval >0 How many messages were sent.
+ * @retval -1 Error, coro_bus_errno() is set.
+ */
+static int
+channel_try_push_v(struct coro_bus_channel *ch, const unsigned *data,
+	unsigned count)
+{
+	if (channel_is_write_closed(ch)) {
+		coro_bus_errno_set(CORO_BUS_ERR_CLOSED);
+		return -1;
+	}
+	unsigned sent = channel_push_v(ch, data, count);
+	if (sent == 0) {
+		/* A shared channel could be closed by the peer meanwhile. */
+		coro_bus_errno_set(channel_is_write_closed(ch) ?
+			CORO_BUS_ERR_CLOSED : CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	channel_handoff(ch);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return (int)sent;
+}
+
+/**
+ * Receive as many messages as there are and fit, and serve the
+ * waiters.
+ *
+ * @retval >0 How many messages were received.
+ * @retval -1 Error, coro_bus_errno() is set.
+ */
+static int
+channel_try_pop_v(struct coro_bus_channel *ch, unsigned *data,
+	unsigned capacity)
+{
+	unsigned received = channel_pop_v(ch, data, capacity);
+	if (received == 0) {
+		if (!channel_is_write_closed(ch)) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		/*
+		 * The peer process could send more right before the
+		 * close. Nothing can be sent after it, a send racing
+		 * with the close fails.
+		 */
+		received = channel_pop_v(ch, data, capacity);
+		if (received == 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_EOF);
+			return -1;
+		}
+	}
+	channel_handoff(ch);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return (int)received;
+}
+
+static struct coro_bus_channel *
+channel_new(size_t size_limit)
+{
+	struct coro_bus_channel *ch = new coro_bus_channel;
+	ch->size_limit = size_limit;
+	rlist_create(&ch->send_queue.coros);
+	rlist_create(&ch->recv_queue.coros);
+	ch->data = NULL;
+	ch->data_count = 0;
+	ch->data_head = 0;
+	ch->send_reserved = 0;
+	rlist_create(&ch->reservations);
+	ch->is_write_closed = false;
+	ch->shm = NULL;
+	ch->shm_size = 0;
+	ch->shm_fd = -1;
+	return ch;
+}
+
+/**
+ * Take the reserved slots from the broadcasts. They will see the
+ * channel is not theirs anymore.
+ */
+static void
+channel_drop_reservations(struct coro_bus_channel *ch)
+{
+	struct slot_reservation *r, *tmp;
+	rlist_foreach_entry_safe(r, &ch->reservations, in_channel, tmp) {
+		r->ch = NULL;
+		rlist_del_entry(r, in_channel);
+	}
+	ch->send_reserved = 0;
+}
+
+static void
+channel_delete(struct coro_bus_channel *ch)
+{
+	channel_drop_reservations(ch);
+	if (ch->shm != NULL) {
+		munmap(ch->shm, ch->shm_size);
+		close(ch->shm_fd);
+	}
+	delete[] ch->data;
+	delete ch;
+}
+
+/** Map the shared memory of the given fd into the channel. */
+static int
+channel_map_shared(struct coro_bus_channel *ch, int fd, size_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+	ch->shm = (struct coro_bus_shm *)mem;
+	ch->shm_size = size;
+	ch->shm_fd = fd;
+	return 0;
+}
+
 static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
 
 enum coro_bus_error_code
@@ -101,28 +680,19 @@ coro_bus_delete(struct coro_bus *bus)
 		return;
 	
 	for (int i = 0; i < bus->channel_count; ++i) {
-		if (bus->channels[i] != nullptr) {
-			struct coro_bus_channel *ch = bus->channels[i];
-			delete[] ch->data;
-			delete ch;
-		}
+		if (bus->channels[i] != nullptr)
+			channel_delete(bus->channels[i]);
 	}
 	delete[] bus->channels;
 	delete bus;
 }
 
-int
-coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+/** Put the channel into a free descriptor of the bus. */
+static int
+coro_bus_channel_add(struct coro_bus *bus, struct coro_bus_channel *ch)
 {
 	for (int i = 0; i < bus->channel_count; ++i) {
 		if (bus->channels[i] == nullptr) {
-			struct coro_bus_channel *ch = new coro_bus_channel;
-			ch->size_limit = size_limit;
-			rlist_create(&ch->send_queue.coros);
-			rlist_create(&ch->recv_queue.coros);
-			ch->data = new unsigned[size_limit];
-			ch->data_count = 0;
-			ch->data_head = 0;
 			bus->channels[i] = ch;
 			coro_bus_errno_set(CORO_BUS_ERR_NONE);
 			return i;
@@ -152,20 +722,108 @@ coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 		bus->channel_capacity = new_capacity;
 	}
 	
-	struct coro_bus_channel *ch = new coro_bus_channel;
-	ch->size_limit = size_limit;
-	rlist_create(&ch->send_queue.coros);
-	rlist_create(&ch->recv_queue.coros);
-	ch->data = new unsigned[size_limit];
-	ch->data_count = 0;
-	ch->data_head = 0;
-	
 	bus->channels[new_channel_id] = ch;
 	bus->channel_count++;
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return new_channel_id;
 }
 
+int
+coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+{
+	struct coro_bus_channel *ch = channel_new(size_limit);
+	ch->data = new unsigned[size_limit];
+	return coro_bus_channel_add(bus, ch);
+}
+
+int
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit)
+{
+#if CORO_BUS_HAS_SHARED
+	if (size_limit > UINT32_MAX / 2 / sizeof(unsigned)) {
+		errno = EINVAL;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	size_t size = sizeof(struct coro_bus_shm) + size_limit * sizeof(unsigned);
+	int fd = memfd_create("corobus", MFD_CLOEXEC);
+	if (fd < 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	struct coro_bus_channel *ch = channel_new(size_limit);
+	if (ftruncate(fd, size) != 0 || channel_map_shared(ch, fd, size) != 0) {
+		int save_errno = errno;
+		close(fd);
+		delete ch;
+		errno = save_errno;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	/* The memory is zeroed, so only the constants are left. */
+	ch->shm->size_limit = size_limit;
+	__atomic_store_n(&ch->shm->magic, CORO_BUS_SHM_MAGIC, __ATOMIC_RELEASE);
+	return coro_bus_channel_add(bus, ch);
+#else
+	(void)bus;
+	(void)size_limit;
+	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	return -1;
+#endif
+}
+
+int
+coro_bus_channel_fd(struct coro_bus *bus, int channel)
+{
+	if (channel < 0 || channel >= bus->channel_count ||
+	    bus->channels[channel] == nullptr ||
+	    bus->channels[channel]->shm == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return bus->channels[channel]->shm_fd;
+}
+
+int
+coro_bus_channel_attach(struct coro_bus *bus, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(struct coro_bus_shm)) {
+		errno = EINVAL;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	int own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (own_fd < 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	struct coro_bus_channel *ch = channel_new(0);
+	if (channel_map_shared(ch, own_fd, st.st_size) != 0) {
+		int save_errno = errno;
+		close(own_fd);
+		delete ch;
+		errno = save_errno;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	struct coro_bus_shm *shm = ch->shm;
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != CORO_BUS_SHM_MAGIC ||
+	    sizeof(*shm) + shm->size_limit * sizeof(unsigned) != ch->shm_size) {
+		channel_delete(ch);
+		errno = EINVAL;
+		coro_bus_errno_set(CORO_BUS_ERR_SYSTEM);
+		return -1;
+	}
+	ch->size_limit = shm->size_limit;
+	return coro_bus_channel_add(bus, ch);
+}
+
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel)
 {
@@ -178,21 +836,52 @@ coro_bus_channel_close(struct coro_bus *bus, int channel)
 	
 	bus->channels[channel] = nullptr;
 	
-	while (!rlist_empty(&ch->send_queue.coros)) {
-		wakeup_queue_wakeup_first(&ch->send_queue);
-	}
-	while (!rlist_empty(&ch->recv_queue.coros)) {
-		wakeup_queue_wakeup_first(&ch->recv_queue);
-	}
-	
-	coro_yield();
+	/*
+	 * The waiters learn about the close from their entries, not
+	 * from the descriptor, which might be reused before they
+	 * run. So there is no need to wait for them.
+	 */
+	wakeup_queue_release_all(&ch->send_queue, CORO_BUS_ERR_NO_CHANNEL);
+	wakeup_queue_release_all(&ch->recv_queue, CORO_BUS_ERR_NO_CHANNEL);
 	
-	delete[] ch->data;
-	delete ch;
+	channel_delete(ch);
 }
 
 int
-coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+coro_bus_channel_close_write(struct coro_bus *bus, int channel)
+{
+	if (channel < 0 || channel >= bus->channel_count ||
+	    bus->channels[channel] == nullptr) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *ch = bus->channels[channel];
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	if (channel_is_write_closed(ch))
+		return 0;
+	
+	if (ch->shm != NULL) {
+		struct coro_bus_shm *shm = ch->shm;
+		__atomic_fetch_or(&shm->tail, CORO_BUS_SHM_CLOSED,
+			__ATOMIC_SEQ_CST);
+#if CORO_BUS_HAS_SHARED
+		if (__atomic_load_n(&shm->recv_waiters, __ATOMIC_SEQ_CST) != 0)
+			futex_wake(&shm->tail);
+#endif
+		return 0;
+	}
+	ch->is_write_closed = true;
+	channel_drop_reservations(ch);
+	wakeup_queue_release_all(&ch->send_queue, CORO_BUS_ERR_CLOSED);
+	/* Waiting receivers mean there is nothing left to drain. */
+	assert(rlist_empty(&ch->recv_queue.coros) || channel_is_empty(ch));
+	wakeup_queue_release_all(&ch->recv_queue, CORO_BUS_ERR_EOF);
+	return 0;
+}
+
+static int
+coro_bus_send_deadline(struct coro_bus *bus, int channel, unsigned data,
+	double deadline)
 {
 	while (true) {
 		if (channel < 0 || channel >= bus->channel_count ||
@@ -209,11 +898,38 @@ coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
 		if (err != CORO_BUS_ERR_WOULD_BLOCK)
 			return -1;
 		
-		struct coro_bus_channel *ch = bus->channels[channel];
-		wakeup_queue_suspend_this(&ch->send_queue);
+		if (deadline_is_passed(deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+		struct wakeup_entry entry;
+		wakeup_entry_create(&entry, &data, 1, NULL);
+		channel_wait_send(bus->channels[channel], &entry, deadline);
+		if (entry.done > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return 0;
+		}
+		if (entry.error != CORO_BUS_ERR_NONE) {
+			coro_bus_errno_set(entry.error);
+			return -1;
+		}
 	}
 }
 
+int
+coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_send_deadline(bus, channel, data, DEADLINE_INFINITY);
+}
+
+int
+coro_bus_send_timeout(struct coro_bus *bus, int channel, unsigned data,
+	double timeout)
+{
+	return coro_bus_send_deadline(bus, channel, data,
+		coro_clock() + timeout);
+}
+
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 {
@@ -228,23 +944,14 @@ coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 		return -1;
 	}
 	
-	if (ch->data_count >= ch->size_limit) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	if (channel_try_push_v(ch, &data, 1) < 0)
 		return -1;
-	}
-	
-	size_t tail = (ch->data_head + ch->data_count) % ch->size_limit;
-	ch->data[tail] = data;
-	ch->data_count++;
-	
-	wakeup_queue_wakeup_first(&ch->recv_queue);
-	
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return 0;
 }
 
-int
-coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+static int
+coro_bus_recv_deadline(struct coro_bus *bus, int channel, unsigned *data,
+	double deadline)
 {
 	while (true) {
 		if (channel < 0 || channel >= bus->channel_count ||
@@ -261,11 +968,38 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
 		if (err != CORO_BUS_ERR_WOULD_BLOCK)
 			return -1;
 		
-		struct coro_bus_channel *ch = bus->channels[channel];
-		wakeup_queue_suspend_this(&ch->recv_queue);
+		if (deadline_is_passed(deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+		struct wakeup_entry entry;
+		wakeup_entry_create(&entry, data, 1, NULL);
+		channel_wait_recv(bus->channels[channel], &entry, deadline);
+		if (entry.done > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return 0;
+		}
+		if (entry.error != CORO_BUS_ERR_NONE) {
+			coro_bus_errno_set(entry.error);
+			return -1;
+		}
 	}
 }
 
+int
+coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_recv_deadline(bus, channel, data, DEADLINE_INFINITY);
+}
+
+int
+coro_bus_recv_timeout(struct coro_bus *bus, int channel, unsigned *data,
+	double timeout)
+{
+	return coro_bus_recv_deadline(bus, channel, data,
+		coro_clock() + timeout);
+}
+
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
@@ -280,30 +1014,68 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
 		return -1;
 	}
 	
-	if (ch->data_count == 0) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	if (channel_try_pop_v(ch, data, 1) < 0)
 		return -1;
-	}
-	
-	*data = ch->data[ch->data_head];
-	ch->data_head = (ch->data_head + 1) % ch->size_limit;
-	ch->data_count--;
-	
-	wakeup_queue_wakeup_first(&ch->send_queue);
-	
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return 0;
 }
 
 
 #if NEED_BROADCAST
 
-int
-coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+/** Whether the channel takes broadcast messages. */
+static inline bool
+broadcast_is_target(const struct coro_bus_channel *ch)
+{
+	return ch != nullptr && !channel_is_write_closed(ch);
+}
+
+/** How many slots of the channel are held by the broadcast. */
+static size_t
+broadcast_held_in(struct rlist *held, const struct coro_bus_channel *ch)
+{
+	size_t count = 0;
+	struct slot_reservation *r;
+	rlist_foreach_entry(r, held, in_owner) {
+		if (r->ch == ch)
+			++count;
+	}
+	return count;
+}
+
+/**
+ * Drop the reservations of the broadcast. The slots of the still
+ * existing channels are given to the next waiters if requested.
+ */
+static void
+broadcast_release(struct rlist *held, bool do_handoff)
+{
+	while (!rlist_empty(held)) {
+		struct slot_reservation *r = rlist_shift_entry(held,
+			struct slot_reservation, in_owner);
+		struct coro_bus_channel *ch = r->ch;
+		if (ch != NULL) {
+			rlist_del_entry(r, in_channel);
+			assert(ch->send_reserved > 0);
+			ch->send_reserved--;
+			if (do_handoff)
+				channel_handoff(ch);
+		}
+		delete r;
+	}
+}
+
+/**
+ * Try to send to all the channels, counting the slots reserved for
+ * this broadcast as free. If can't, a full channel is returned to
+ * wait on.
+ */
+static int
+coro_bus_broadcast_held(struct coro_bus *bus, unsigned data,
+	struct rlist *held, struct coro_bus_channel **full)
 {
 	int active_count = 0;
 	for (int i = 0; i < bus->channel_count; ++i) {
-		if (bus->channels[i] != nullptr)
+		if (broadcast_is_target(bus->channels[i]))
 			active_count++;
 	}
 	
@@ -314,47 +1086,77 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 	
 	for (int i = 0; i < bus->channel_count; ++i) {
 		struct coro_bus_channel *ch = bus->channels[i];
-		if (ch != nullptr && ch->data_count >= ch->size_limit) {
+		if (broadcast_is_target(ch) && channel_is_full(ch) &&
+		    broadcast_held_in(held, ch) == 0) {
+			*full = ch;
 			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 			return -1;
 		}
 	}
+	/* The reserved slots are taken by the message right away. */
+	broadcast_release(held, false);
 	
 	for (int i = 0; i < bus->channel_count; ++i) {
 		struct coro_bus_channel *ch = bus->channels[i];
-		if (ch == nullptr)
+		if (!broadcast_is_target(ch))
 			continue;
 		
-		size_t tail = (ch->data_head + ch->data_count) % ch->size_limit;
-		ch->data[tail] = data;
-		ch->data_count++;
+		channel_push_v(ch, &data, 1);
 		
-		wakeup_queue_wakeup_first(&ch->recv_queue);
+		channel_handoff(ch);
 	}
 	
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	return 0;
 }
 
+int
+coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+{
+	struct rlist held;
+	rlist_create(&held);
+	struct coro_bus_channel *full;
+	return coro_bus_broadcast_held(bus, data, &held, &full);
+}
+
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 {
+	/*
+	 * Each time a full channel gets a free slot, the slot is
+	 * reserved for the broadcast and kept while it waits for the
+	 * other channels. So the concurrent senders can't starve it.
+	 */
+	struct rlist held;
+	rlist_create(&held);
 	while (true) {
-		int rc = coro_bus_try_broadcast(bus, data);
+		struct coro_bus_channel *full = NULL;
+		int rc = coro_bus_broadcast_held(bus, data, &held, &full);
 		if (rc == 0)
 			return 0;
 		
 		enum coro_bus_error_code err = coro_bus_errno();
-		if (err != CORO_BUS_ERR_WOULD_BLOCK)
+		if (err != CORO_BUS_ERR_WOULD_BLOCK) {
+			broadcast_release(&held, true);
+			coro_bus_errno_set(err);
 			return -1;
+		}
 		
-		for (int i = 0; i < bus->channel_count; ++i) {
-			struct coro_bus_channel *ch = bus->channels[i];
-			if (ch != nullptr && ch->data_count >= ch->size_limit) {
-				wakeup_queue_suspend_this(&ch->send_queue);
-				break;
-			}
+		if (full->shm != NULL) {
+			channel_wait_shared(full, true, DEADLINE_INFINITY);
+			continue;
 		}
+		struct slot_reservation *r = new slot_reservation;
+		r->ch = NULL;
+		rlist_create(&r->in_channel);
+		struct wakeup_entry entry;
+		wakeup_entry_create(&entry, NULL, 0, r);
+		wakeup_queue_suspend_this(&full->send_queue, &entry,
+			DEADLINE_INFINITY);
+		if (r->ch != NULL)
+			rlist_add_tail_entry(&held, r, in_owner);
+		else
+			delete r;
 	}
 }
 
@@ -376,29 +1178,12 @@ coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, uns
 		return -1;
 	}
 	
-	if (ch->data_count >= ch->size_limit) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
-	}
-	
-	unsigned sent = 0;
-	while (sent < count && ch->data_count < ch->size_limit) {
-		size_t tail = (ch->data_head + ch->data_count) % ch->size_limit;
-		ch->data[tail] = data[sent];
-		ch->data_count++;
-		sent++;
-	}
-	
-	for (unsigned i = 0; i < sent; ++i) {
-		wakeup_queue_wakeup_first(&ch->recv_queue);
-	}
-	
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return (int)sent;
+	return channel_try_push_v(ch, data, count);
 }
 
-int
-coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+static int
+coro_bus_send_v_deadline(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count, double deadline)
 {
 	while (true) {
 		if (channel < 0 || channel >= bus->channel_count ||
@@ -415,11 +1200,39 @@ coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigne
 		if (err != CORO_BUS_ERR_WOULD_BLOCK)
 			return -1;
 		
-		struct coro_bus_channel *ch = bus->channels[channel];
-		wakeup_queue_suspend_this(&ch->send_queue);
+		if (deadline_is_passed(deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+		struct wakeup_entry entry;
+		wakeup_entry_create(&entry, (unsigned *)data, count, NULL);
+		channel_wait_send(bus->channels[channel], &entry, deadline);
+		if (entry.done > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return (int)entry.done;
+		}
+		if (entry.error != CORO_BUS_ERR_NONE) {
+			coro_bus_errno_set(entry.error);
+			return -1;
+		}
 	}
 }
 
+int
+coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+{
+	return coro_bus_send_v_deadline(bus, channel, data, count,
+		DEADLINE_INFINITY);
+}
+
+int
+coro_bus_send_v_timeout(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count, double timeout)
+{
+	return coro_bus_send_v_deadline(bus, channel, data, count,
+		coro_clock() + timeout);
+}
+
 int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
@@ -434,29 +1247,12 @@ coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned
 		return -1;
 	}
 	
-	if (ch->data_count == 0) {
-		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-		return -1;
-	}
-	
-	unsigned received = 0;
-	while (received < capacity && ch->data_count > 0) {
-		data[received] = ch->data[ch->data_head];
-		ch->data_head = (ch->data_head + 1) % ch->size_limit;
-		ch->data_count--;
-		received++;
-	}
-	
-	for (unsigned i = 0; i < received; ++i) {
-		wakeup_queue_wakeup_first(&ch->send_queue);
-	}
-	
-	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	return (int)received;
+	return channel_try_pop_v(ch, data, capacity);
 }
 
-int
-coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+static int
+coro_bus_recv_v_deadline(struct coro_bus *bus, int channel, unsigned *data,
+	unsigned capacity, double deadline)
 {
 	while (true) {
 		if (channel < 0 || channel >= bus->channel_count ||
@@ -473,9 +1269,37 @@ coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capa
 		if (err != CORO_BUS_ERR_WOULD_BLOCK)
 			return -1;
 		
-		struct coro_bus_channel *ch = bus->channels[channel];
-		wakeup_queue_suspend_this(&ch->recv_queue);
+		if (deadline_is_passed(deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+		struct wakeup_entry entry;
+		wakeup_entry_create(&entry, data, capacity, NULL);
+		channel_wait_recv(bus->channels[channel], &entry, deadline);
+		if (entry.done > 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return (int)entry.done;
+		}
+		if (entry.error != CORO_BUS_ERR_NONE) {
+			coro_bus_errno_set(entry.error);
+			return -1;
+		}
 	}
 }
 
+int
+coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+{
+	return coro_bus_recv_v_deadline(bus, channel, data, capacity,
+		DEADLINE_INFINITY);
+}
+
+int
+coro_bus_recv_v_timeout(struct coro_bus *bus, int channel, unsigned *data,
+	unsigned capacity, double timeout)
+{
+	return coro_bus_recv_v_deadline(bus, channel, data, capacity,
+		coro_clock() + timeout);
+}
+
 #endif
@@ -11,6 +11,10 @@ enum coro_bus_error_code {
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_SYSTEM,
+	CORO_BUS_ERR_TIMEOUT,
+	CORO_BUS_ERR_CLOSED,
+	CORO_BUS_ERR_EOF,
 };
 
 struct coro_bus;
@@ -47,6 +51,62 @@ coro_bus_delete(struct coro_bus *bus);
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Create a channel which keeps its messages in a shared memory
+ * region, so it can connect coroutines of different processes.
+ * The region survives fork(), and can be passed to an unrelated
+ * process via coro_bus_channel_fd() + coro_bus_channel_attach().
+ * All the send/recv functions work with such a channel the same
+ * way as with a normal one.
+ *
+ * Each end of a shared channel must be used by one process at a
+ * time: one process sends, another one receives. When a blocking
+ * call can't progress and no other coroutine in the process is
+ * ready to run, the whole thread sleeps on a futex until the
+ * peer process changes the channel.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold in memory
+ *     at once.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SYSTEM - couldn't create the shared memory,
+ *       errno is set.
+ */
+int
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Get the file descriptor of the shared memory behind the given
+ * shared channel. The descriptor is owned by the channel and is
+ * closed together with it.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the shared channel.
+ *
+ * @retval >=0 File descriptor.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist or
+ *       isn't shared.
+ */
+int
+coro_bus_channel_fd(struct coro_bus *bus, int channel);
+
+/**
+ * Open a channel in the bus on top of an existing shared memory
+ * region, created by coro_bus_channel_open_shared() possibly in
+ * another process. The file descriptor is duplicated, the caller
+ * still owns the passed one.
+ * @param bus The bus to create the channel in.
+ * @param fd File descriptor of the shared memory.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SYSTEM - couldn't map the memory or it is
+ *       not a channel, errno is set.
+ */
+int
+coro_bus_channel_attach(struct coro_bus *bus, int fd);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -58,6 +118,26 @@ coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel);
 
+/**
+ * Close the channel for writing. The messages already in the
+ * channel stay there and can be received as usual. When the
+ * channel is drained, the receivers get an error instead of
+ * waiting. The senders, including the suspended ones, get an
+ * error right away. The descriptor stays valid until
+ * coro_bus_channel_close(). For a shared channel the peer process
+ * sees the close too, and either process may close it, even while
+ * the other one is sending. A send racing with the close either
+ * completes before it, or fails as closed.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to close for writing.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_close_write(struct coro_bus *bus, int channel);
+
 /**
  * Send the given message to the specified channel. If the channel
  * is full, the function should suspend the current coroutine and
@@ -69,10 +149,32 @@ coro_bus_channel_close(struct coro_bus *bus, int channel);
  * @retval 0 Success.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CLOSED - the channel is closed for
+ *       writing.
  */
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
 
+/**
+ * Same as coro_bus_send(), but gives up when the channel stays
+ * full for longer than the timeout.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Data to send.
+ * @param timeout Timeout in seconds.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CLOSED - the channel is closed for
+ *       writing.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel was full until the
+ *       timeout expired.
+ */
+int
+coro_bus_send_timeout(struct coro_bus *bus, int channel, unsigned data,
+	double timeout);
+
 /**
  * Same as coro_bus_send(), but if the channel is full, the
  * function immediately returns. It never suspends the current
@@ -84,6 +186,8 @@ coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
  * @retval 0 Success.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CLOSED - the channel is closed for
+ *       writing.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
  */
 int
@@ -101,10 +205,33 @@ coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
  *     message.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_EOF - the channel is closed for writing
+ *       and has no more messages.
  */
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Same as coro_bus_recv(), but gives up when the channel stays
+ * empty for longer than the timeout.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param data Output parameter to save the data to.
+ * @param timeout Timeout in seconds.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_EOF - the channel is closed for writing
+ *       and has no more messages.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel was empty until the
+ *       timeout expired.
+ */
+int
+coro_bus_recv_timeout(struct coro_bus *bus, int channel, unsigned *data,
+	double timeout);
+
 /**
  * Same as coro_bus_recv(), but if the channel is empty, the
  * function immediately returns. It never suspends the current
@@ -117,6 +244,8 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
  *     message.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_EOF - the channel is closed for writing
+ *       and has no more messages.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
  */
 int
@@ -129,7 +258,8 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
  * Send the given message to all the registered channels at once.
  * If any of the channels are full, then the message isn't sent
  * anywhere, and the coroutine is suspended until can submit the
- * data to all the channels.
+ * data to all the channels. The channels closed for writing are
+ * skipped.
  * @param bus Bus where the channels are located.
  * @param data Data to send.
  *
@@ -174,11 +304,34 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
  *     messages are sent, they are guaranteed data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CLOSED - the channel is closed for
+ *       writing.
  */
 int
 coro_bus_send_v(struct coro_bus *bus, int channel,
 	const unsigned *data, unsigned count);
 
+/**
+ * Same as coro_bus_send_v(), but gives up when the channel stays
+ * full for longer than the timeout.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param data Array of messages to send.
+ * @param count Size of @a data.
+ * @param timeout Timeout in seconds.
+ *
+ * @retval >0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CLOSED - the channel is closed for
+ *       writing.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel was full until the
+ *       timeout expired.
+ */
+int
+coro_bus_send_v_timeout(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count, double timeout);
+
 /**
  * Same as coro_bus_send_v(), but fails instantly in case the
  * channel is full and doesn't fit a single message.
@@ -192,6 +345,8 @@ coro_bus_send_v(struct coro_bus *bus, int channel,
  *     messages are sent, they are guaranteed data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CLOSED - the channel is closed for
+ *       writing.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
  */
 int
@@ -215,11 +370,34 @@ coro_bus_try_send_v(struct coro_bus *bus, int channel,
  *     data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_EOF - the channel is closed for writing
+ *       and has no more messages.
  */
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
+/**
+ * Same as coro_bus_recv_v(), but gives up when the channel stays
+ * empty for longer than the timeout.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param data Array to save the received messages into.
+ * @param count Capacity of @a data.
+ * @param timeout Timeout in seconds.
+ *
+ * @retval >0 Success, how many messages were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_EOF - the channel is closed for writing
+ *       and has no more messages.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel was empty until the
+ *       timeout expired.
+ */
+int
+coro_bus_recv_v_timeout(struct coro_bus *bus, int channel,
+	unsigned *data, unsigned capacity, double timeout);
+
 /**
  * Same as coro_bus_recv_v(), but fails instantly if the channel
  * is empty.
@@ -234,6 +412,8 @@ coro_bus_recv_v(struct coro_bus *bus, int channel,
  *     data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_EOF - the channel is closed for writing
+ *       and has no more messages.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
  */
 int
@@ -9,8 +9,10 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
+#include <math.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
@@ -43,6 +45,12 @@ struct coro {
 	struct coro *joiner;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/** When to wake the coroutine up if it sleeps with a timeout. */
+	double deadline;
+	/** Link in the list of coroutines sleeping with a timeout. */
+	struct rlist timer_link;
+	/** The last timed suspension ended by the timeout. */
+	bool is_timed_out;
 };
 
 struct coro_engine {
@@ -67,8 +75,15 @@ struct coro_engine {
 	struct rlist coros_running_next;
 	/** Joined coroutines to be reused. */
 	struct rlist coros_pool;
+	/**
+	 * Coroutines suspended with a timeout, sorted by the
+	 * deadline.
+	 */
+	struct rlist timers;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/** Number of context switches between the coroutines. */
+	unsigned long long switch_count;
 	/**
 	 * Buffer, used by the coroutine constructor to escape
 	 * from the signal handler back into the constructor to
@@ -85,6 +100,15 @@ coro_engine_create(struct coro_engine *engine)
 	rlist_create(&engine->coros_running_now);
 	rlist_create(&engine->coros_running_next);
 	rlist_create(&engine->coros_pool);
+	rlist_create(&engine->timers);
+}
+
+static double
+coro_clock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 static void
@@ -97,6 +121,7 @@ coro_engine_resume_next(struct coro_engine *engine)
 	assert(from != NULL);
 
 	engine->this_coro = NULL;
+	++engine->switch_count;
 	if (sigsetjmp(from->ctx, 0) == 0)
 		siglongjmp(to->ctx, 1);
 	assert(rlist_empty(&from->link));
@@ -142,15 +167,110 @@ coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
 	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
 }
 
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, double timeout)
+{
+	struct coro *this_coro = engine->this_coro;
+	assert(rlist_empty(&this_coro->timer_link));
+	this_coro->deadline = coro_clock_now() + timeout;
+	this_coro->is_timed_out = false;
+	/*
+	 * Timeouts are usually the same, so the new deadline is
+	 * most likely the latest one. Search from the tail.
+	 */
+	struct rlist *pos = engine->timers.prev;
+	while (pos != &engine->timers) {
+		struct coro *c = rlist_entry(pos, struct coro, timer_link);
+		if (c->deadline <= this_coro->deadline)
+			break;
+		pos = pos->prev;
+	}
+	rlist_add(pos, &this_coro->timer_link);
+	coro_engine_suspend(engine);
+	/* Woken up before the deadline. */
+	if (!rlist_empty(&this_coro->timer_link))
+		rlist_del(&this_coro->timer_link);
+	return this_coro->is_timed_out;
+}
+
+/** Wake up the coroutines whose deadlines have passed. */
+static void
+coro_engine_fire_timers(struct coro_engine *engine)
+{
+	if (rlist_empty(&engine->timers))
+		return;
+	double now = coro_clock_now();
+	while (!rlist_empty(&engine->timers)) {
+		struct coro *c = rlist_first_entry(&engine->timers,
+			struct coro, timer_link);
+		if (c->deadline > now)
+			break;
+		rlist_del(&c->timer_link);
+		/* Could be woken up already, then it isn't a timeout. */
+		if (c->state == CORO_STATE_SUSPENDED) {
+			c->is_timed_out = true;
+			coro_engine_wakeup(engine, c);
+		}
+	}
+}
+
+/**
+ * Nothing is runnable - sleep until the nearest deadline. The
+ * coroutines can only be woken up by a timer then.
+ */
+static void
+coro_engine_sleep(struct coro_engine *engine)
+{
+	struct coro *c = rlist_first_entry(&engine->timers,
+		struct coro, timer_link);
+	double timeout = c->deadline - coro_clock_now();
+	if (timeout <= 0)
+		return;
+	struct timespec ts;
+	ts.tv_sec = (time_t)timeout;
+	ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+	}
+}
+
+static bool
+coro_engine_has_ready(struct coro_engine *engine)
+{
+	if (engine->this_coro == NULL)
+		return false;
+	if (!rlist_empty(&engine->coros_running_next))
+		return true;
+	/*
+	 * The scheduler is always in the end of the current
+	 * iteration list. Anything before it is runnable.
+	 */
+	return !rlist_empty(&engine->coros_running_now) &&
+		rlist_first(&engine->coros_running_now) != &engine->sched.link;
+}
+
+static double
+coro_engine_next_deadline(struct coro_engine *engine)
+{
+	if (rlist_empty(&engine->timers))
+		return HUGE_VAL;
+	return rlist_first_entry(&engine->timers, struct coro,
+		timer_link)->deadline;
+}
+
 static void
 coro_engine_run(struct coro_engine *engine)
 {
 	while (true) {
 		assert(rlist_empty(&engine->coros_running_now));
+		coro_engine_fire_timers(engine);
 		rlist_splice_tail(&engine->coros_running_now,
 			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+		if (rlist_empty(&engine->coros_running_now)) {
+			if (rlist_empty(&engine->timers))
+				break;
+			coro_engine_sleep(engine);
+			continue;
+		}
 
 		assert(engine->this_coro == NULL);
 		engine->this_coro = &engine->sched;
@@ -175,6 +295,7 @@ coro_engine_destroy(struct coro_engine *engine)
 	assert(engine->this_coro == NULL);
 	assert(rlist_empty(&engine->coros_running_now));
 	assert(rlist_empty(&engine->coros_running_next));
+	assert(rlist_empty(&engine->timers));
 	while (!rlist_empty(&engine->coros_pool)) {
 		struct coro *c = rlist_shift_entry(&engine->coros_pool,
 			struct coro, link);
@@ -246,6 +367,9 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	c->func_arg = func_arg;
 	c->joiner = NULL;
 	rlist_create(&c->link);
+	c->deadline = 0;
+	rlist_create(&c->timer_link);
+	c->is_timed_out = false;
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -376,6 +500,18 @@ coro_this(void)
 	return glob_engine.this_coro;
 }
 
+bool
+coro_sched_has_ready(void)
+{
+	return coro_engine_has_ready(&glob_engine);
+}
+
+double
+coro_sched_next_deadline(void)
+{
+	return coro_engine_next_deadline(&glob_engine);
+}
+
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
@@ -394,6 +530,24 @@ coro_suspend(void)
 	coro_engine_suspend(&glob_engine);
 }
 
+bool
+coro_suspend_timeout(double timeout)
+{
+	return coro_engine_suspend_timeout(&glob_engine, timeout);
+}
+
+unsigned long long
+coro_switch_count(void)
+{
+	return glob_engine.switch_count;
+}
+
+double
+coro_clock(void)
+{
+	return coro_clock_now();
+}
+
 void
 coro_yield(void)
 {
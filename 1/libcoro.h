@@ -27,6 +27,23 @@ coro_sched_destroy(void);
 struct coro *
 coro_this(void);
 
+/**
+ * Check if there are any coroutines other than the current one
+ * ready to run. Can be used to decide whether it is fine to block
+ * the whole thread in a syscall, or better to yield to the others
+ * first.
+ */
+bool
+coro_sched_has_ready(void);
+
+/**
+ * Get the nearest deadline of the coroutines suspended with a
+ * timeout, or HUGE_VAL if there are none. A blocking syscall
+ * shouldn't last longer, or they won't wake up on time.
+ */
+double
+coro_sched_next_deadline(void);
+
 /**
  * Create a new coroutine. The function won't yield. The coroutine
  * will start execution automatically on the next iteration of the
@@ -54,6 +71,28 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but the coroutine is also woken up
+ * automatically when the timeout expires.
+ * @param timeout Timeout in seconds.
+ *
+ * @retval true The timeout expired.
+ * @retval false Woken up with coro_wakeup() before the timeout.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/**
+ * Get the number of coroutine context switches done so far. Can
+ * be used to see how many switches an operation costs.
+ */
+unsigned long long
+coro_switch_count(void);
+
+/** Get the monotonic time in seconds, used for timeouts. */
+double
+coro_clock(void);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
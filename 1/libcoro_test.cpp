@@ -2,6 +2,9 @@
 
 #include "unit.h"
 
+#include <math.h>
+#include <stdint.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +165,43 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_sleep_f(void *arg)
+{
+	double timeout = *(double *)arg;
+	return (void *)(intptr_t)coro_suspend_timeout(timeout);
+}
+
+static void
+test_suspend_timeout(void)
+{
+	unit_test_start();
+
+	double start = coro_clock();
+	unit_check(coro_sched_next_deadline() == HUGE_VAL, "no deadlines");
+	unit_check(coro_suspend_timeout(0.01), "timed out");
+	unit_check(coro_clock() - start >= 0.01, "slept enough");
+
+	double long_timeout = 10;
+	double short_timeout = 0.02;
+	struct coro *c1 = coro_new(test_sleep_f, &long_timeout);
+	struct coro *c2 = coro_new(test_sleep_f, &short_timeout);
+	struct coro *c3 = coro_new(test_sleep_f, &long_timeout);
+	coro_yield();
+	unit_check(coro_sched_next_deadline() < start + 5,
+		"the nearest deadline is the short one");
+	unit_check(coro_join(c2) == (void *)1, "short sleep timed out");
+	coro_wakeup(c3);
+	coro_wakeup(c1);
+	unit_check(coro_join(c1) == NULL, "long sleep woken up");
+	unit_check(coro_join(c3) == NULL, "another long sleep woken up");
+	unit_check(coro_clock() - start < 5, "did not wait for the long ones");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,6 +211,7 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_suspend_timeout();
 	return NULL;
 }
 
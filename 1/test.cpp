@@ -4,6 +4,8 @@
 #include "corobus.h"
 
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -766,6 +768,102 @@ test_close_non_empty_bus(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_close_write(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("fill a channel and start a sender");
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 3);
+	coro_yield();
+	unit_assert(send_ctx.is_started && !send_ctx.is_done);
+
+	unit_msg("close for writing - the senders fail");
+	unit_assert(coro_bus_channel_close_write(bus, c1) == 0);
+	unit_assert(send_join(&send_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CLOSED);
+	unit_assert(coro_bus_try_send(bus, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CLOSED);
+	unit_assert(coro_bus_send(bus, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CLOSED);
+	unit_assert(coro_bus_channel_close_write(bus, c1) == 0);
+
+	unit_msg("the receivers drain the channel and get EOF");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_EOF);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_EOF);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_channel_close_write(bus, c1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("suspended receivers are woken up with EOF");
+	c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	unsigned data1 = 0;
+	struct ctx_recv recv_ctx1;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	unsigned data2 = 0;
+	struct ctx_recv recv_ctx2;
+	recv_start(&recv_ctx2, bus, c1, &data2);
+	coro_yield();
+	unit_assert(!recv_ctx1.is_done && !recv_ctx2.is_done);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_channel_close_write(bus, c1) == 0);
+	unit_assert(recv_join(&recv_ctx1) == 0 && data1 == 5);
+	unit_assert(recv_join(&recv_ctx2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_EOF);
+	coro_bus_channel_close(bus, c1);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast skips the channels closed for writing");
+	c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send(bus, c2, 6) == 0);
+	unit_assert(coro_bus_channel_close_write(bus, c2) == 0);
+	unit_assert(coro_bus_broadcast(bus, 7) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 7);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 6);
+	unit_assert(coro_bus_channel_close_write(bus, c1) == 0);
+	unit_assert(coro_bus_try_broadcast(bus, 8) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+#endif
+
+	unit_msg("full close doesn't wait for the woken up coroutines");
+	c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	coro_bus_channel_close(bus, c1);
+	unit_assert(!recv_ctx1.is_done);
+	/* The waiter must not mistake a new channel for its own. */
+	int c3 = coro_bus_channel_open(bus, 2);
+	unit_assert(c3 == c1);
+	unit_assert(coro_bus_send(bus, c3, 9) == 0);
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 9);
+	coro_bus_channel_close(bus, c3);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 #if NEED_BROADCAST
 struct ctx_broadcast {
 	struct coro_bus *bus;
@@ -1016,6 +1114,72 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_wakeup_handoff(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+
+	unit_msg("a freed slot goes to the waiting sender");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	struct ctx_send ctx_s;
+	send_start(&ctx_s, bus, c1, 2);
+	coro_yield();
+	unit_assert(ctx_s.is_started && !ctx_s.is_done);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(send_join(&ctx_s) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 2);
+
+	unit_msg("a sent message goes to the waiting receiver");
+	struct ctx_recv ctx_r;
+	unsigned recv_data = 0;
+	recv_start(&ctx_r, bus, c1, &recv_data);
+	coro_yield();
+	unit_assert(ctx_r.is_started && !ctx_r.is_done);
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(recv_join(&ctx_r) == 0 && recv_data == 4);
+
+#if NEED_BROADCAST
+	unit_msg("a broadcast is not starved by the senders");
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(coro_bus_send(bus, c2, 6) == 0);
+	struct ctx_broadcast ctx_b;
+	broadcast_start(&ctx_b, bus, 999);
+	coro_yield();
+	unit_assert(ctx_b.is_started && !ctx_b.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+	/* The freed slot is kept while the broadcast waits for c2. */
+	unit_assert(coro_bus_try_send(bus, c1, 7) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_yield();
+	unit_assert(!ctx_b.is_done);
+	unit_assert(coro_bus_try_send(bus, c1, 7) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 6);
+	unit_assert(coro_bus_try_send(bus, c2, 8) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(broadcast_join(&ctx_b) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 999);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 999);
+	coro_bus_channel_close(bus, c2);
+#endif
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_send_vector_basic(void)
 {
@@ -1606,6 +1770,417 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct ctx_recv_timeout {
+	struct coro_bus *bus;
+	int channel;
+	double timeout;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+recv_timeout_f(void *arg)
+{
+	struct ctx_recv_timeout *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_recv_timeout(ctx->bus, ctx->channel, &ctx->data,
+		ctx->timeout);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+recv_timeout_start(struct ctx_recv_timeout *ctx, struct coro_bus *bus,
+	int channel, double timeout)
+{
+	ctx->bus = bus;
+	ctx->channel = channel;
+	ctx->timeout = timeout;
+	ctx->data = 0;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(recv_timeout_f, ctx);
+}
+
+static void
+test_send_recv_timeout(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+
+	unit_msg("recv times out on an empty channel");
+	unsigned data = 0;
+	double start = coro_clock();
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, 0.05) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_clock() - start >= 0.05);
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+
+	unit_msg("send times out on a full channel");
+	unit_assert(coro_bus_send_timeout(bus, c1, 1, 0.01) == 0);
+	unit_assert(coro_bus_send_timeout(bus, c1, 2, 0.01) == 0);
+	unit_assert(coro_bus_send_timeout(bus, c1, 3, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, 0.01) == 0);
+	unit_assert(data == 1);
+	unit_assert(coro_bus_recv_timeout(bus, c1, &data, 0.01) == 0);
+	unit_assert(data == 2);
+
+	unit_msg("a waiter in the middle of the queue times out");
+	struct ctx_recv_timeout ctx1, ctx2, ctx3;
+	recv_timeout_start(&ctx1, bus, c1, 10);
+	recv_timeout_start(&ctx2, bus, c1, 0.02);
+	recv_timeout_start(&ctx3, bus, c1, 10);
+	coro_yield();
+	unit_assert(!ctx1.is_done && !ctx2.is_done && !ctx3.is_done);
+	unit_assert(coro_join(ctx2.worker) == NULL);
+	unit_assert(ctx2.rc != 0 && ctx2.err == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(!ctx1.is_done && !ctx3.is_done);
+
+	unit_msg("the others are still in the queue, in order");
+	unit_assert(coro_bus_send(bus, c1, 10) == 0);
+	unit_assert(coro_bus_send(bus, c1, 20) == 0);
+	unit_assert(coro_join(ctx1.worker) == NULL);
+	unit_assert(ctx1.rc == 0 && ctx1.data == 10);
+	unit_assert(coro_join(ctx3.worker) == NULL);
+	unit_assert(ctx3.rc == 0 && ctx3.data == 20);
+
+	unit_msg("woken up in time");
+	recv_timeout_start(&ctx1, bus, c1, 10);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 30) == 0);
+	start = coro_clock();
+	unit_assert(coro_join(ctx1.worker) == NULL);
+	unit_assert(coro_clock() - start < 1);
+	unit_assert(ctx1.rc == 0 && ctx1.data == 30);
+
+	unit_msg("the channel is closed during the wait");
+	recv_timeout_start(&ctx1, bus, c1, 10);
+	coro_yield();
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_join(ctx1.worker) == NULL);
+	unit_assert(ctx1.rc != 0 && ctx1.err == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_send_recv_vector_timeout(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+
+	unsigned datas[5] = {1, 2, 3, 4, 5};
+	unit_assert(coro_bus_recv_v_timeout(bus, c1, datas, 5, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_send_v_timeout(bus, c1, datas, 5, 0.01) == 3);
+	unit_assert(coro_bus_send_v_timeout(bus, c1, datas, 5, 0.01) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unsigned out[5] = {0};
+	unit_assert(coro_bus_recv_v_timeout(bus, c1, out, 5, 0.01) == 3);
+	unit_assert(out[0] == 1 && out[1] == 2 && out[2] == 3);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_shared_channel_attach(void)
+{
+	unit_test_start();
+	struct coro_bus *bus1 = coro_bus_new();
+	struct coro_bus *bus2 = coro_bus_new();
+
+	unit_msg("local channels have no fd");
+	int c1 = coro_bus_channel_open(bus1, 3);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_channel_fd(bus1, c1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel_close(bus1, c1);
+
+	unit_msg("open a shared channel and attach from another bus");
+	c1 = coro_bus_channel_open_shared(bus1, 3);
+	unit_assert(c1 >= 0);
+	int fd = coro_bus_channel_fd(bus1, c1);
+	unit_assert(fd >= 0);
+	int c2 = coro_bus_channel_attach(bus2, fd);
+	unit_assert(c2 >= 0);
+
+	unit_msg("the ring is seen from both sides");
+	unit_assert(coro_bus_send(bus1, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus1, c1, 2) == 0);
+	unit_assert(coro_bus_send(bus1, c1, 3) == 0);
+	unit_assert(coro_bus_try_send(bus1, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus2, c2, &data) == 0 && data == 1);
+	unit_assert(coro_bus_try_send(bus1, c1, 4) == 0);
+	unsigned datas[5] = {0};
+	unit_assert(coro_bus_try_recv_v(bus2, c2, datas, 5) == 3);
+	unit_assert(datas[0] == 2 && datas[1] == 3 && datas[2] == 4);
+	unit_assert(coro_bus_try_recv(bus2, c2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("wrap around the ring many times with batches");
+	unsigned next_send = 0;
+	unsigned next_recv = 0;
+	for (int i = 0; i < 100; ++i) {
+		unsigned batch[2] = {next_send, next_send + 1};
+		int rc = coro_bus_try_send_v(bus1, c1, batch, 2);
+		unit_assert(rc == 2);
+		next_send += rc;
+		rc = coro_bus_try_recv_v(bus2, c2, datas, 5);
+		unit_assert(rc == 2);
+		for (int j = 0; j < rc; ++j)
+			unit_assert(datas[j] == next_recv++);
+	}
+
+	unit_msg("not a channel can't be attached");
+	int pipefd[2];
+	unit_assert(pipe(pipefd) == 0);
+	unit_assert(coro_bus_channel_attach(bus2, pipefd[0]) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_SYSTEM);
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	coro_bus_channel_close(bus2, c2);
+	coro_bus_channel_close(bus1, c1);
+	coro_bus_delete(bus2);
+	coro_bus_delete(bus1);
+	unit_test_finish();
+}
+
+struct ctx_sleep_send {
+	struct coro_bus *bus;
+	int channel;
+	double timeout;
+	double woken_at;
+};
+
+static void *
+sleep_send_f(void *arg)
+{
+	struct ctx_sleep_send *ctx = (decltype(ctx))arg;
+	unit_assert(coro_suspend_timeout(ctx->timeout));
+	ctx->woken_at = coro_clock();
+	unit_assert(coro_bus_send(ctx->bus, ctx->channel, 1) == 0);
+	return NULL;
+}
+
+static void
+test_shared_channel_blocking_local(void)
+{
+	unit_test_start();
+	struct coro_bus *bus1 = coro_bus_new();
+	struct coro_bus *bus2 = coro_bus_new();
+	int c1 = coro_bus_channel_open_shared(bus1, 1);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_attach(bus2, coro_bus_channel_fd(bus1, c1));
+	unit_assert(c2 >= 0);
+
+	unit_msg("sender and receiver in the same process");
+	const unsigned data_count = 10000;
+	struct ctx_stress_send ctx;
+	ctx.bus = bus1;
+	ctx.channel = c1;
+	ctx.next_data = 0;
+	ctx.last_data = data_count;
+	struct coro *sender = coro_new(stress_send_f, &ctx);
+	for (unsigned i = 0; i < data_count; ++i) {
+		unsigned data = 0;
+		unit_assert(coro_bus_recv(bus2, c2, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_join(sender) == NULL);
+
+	unit_msg("timeout while nobody sends");
+	unsigned data = 0;
+	unit_assert(coro_bus_recv_timeout(bus2, c2, &data, 0.02) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+
+	unit_msg("a sleeping coroutine wakes up while recv blocks");
+	struct ctx_sleep_send sleep_ctx;
+	sleep_ctx.bus = bus1;
+	sleep_ctx.channel = c1;
+	sleep_ctx.timeout = 0.01;
+	sleep_ctx.woken_at = 0;
+	double start = coro_clock();
+	struct coro *sleeper = coro_new(sleep_send_f, &sleep_ctx);
+	unit_assert(coro_bus_recv_timeout(bus2, c2, &data, 1) == 0);
+	unit_assert(data == 1);
+	unit_assert(sleep_ctx.woken_at - start < 0.1);
+	unit_assert(coro_join(sleeper) == NULL);
+
+	coro_bus_channel_close(bus2, c2);
+	coro_bus_channel_close(bus1, c1);
+	coro_bus_delete(bus2);
+	coro_bus_delete(bus1);
+	unit_test_finish();
+}
+
+static void
+test_shared_channel_fork(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int to_child = coro_bus_channel_open_shared(bus, 7);
+	unit_assert(to_child >= 0);
+	int to_parent = coro_bus_channel_open_shared(bus, 5);
+	unit_assert(to_parent >= 0);
+
+	const unsigned data_count = 100000;
+	pid_t pid = fork();
+	unit_assert(pid >= 0);
+	if (pid == 0) {
+		/* Echo everything back, incremented. */
+		unsigned datas[16];
+		unsigned received = 0;
+		while (received < data_count) {
+			int rc = coro_bus_recv_v(bus, to_child, datas, 16);
+			if (rc <= 0)
+				_exit(1);
+			for (int i = 0; i < rc; ++i)
+				datas[i]++;
+			for (int sent = 0; sent < rc;) {
+				int n = coro_bus_send_v(bus, to_parent,
+					datas + sent, rc - sent);
+				if (n <= 0)
+					_exit(1);
+				sent += n;
+			}
+			received += rc;
+		}
+		_exit(0);
+	}
+
+	unit_msg("send to the child and get the replies");
+	unsigned next_send = 0;
+	unsigned next_recv = 1;
+	while (next_recv <= data_count) {
+		if (next_send < data_count &&
+		    coro_bus_try_send(bus, to_child, next_send) == 0) {
+			++next_send;
+			continue;
+		}
+		unsigned data = 0;
+		unit_assert(coro_bus_recv(bus, to_parent, &data) == 0);
+		unit_assert(data == next_recv);
+		++next_recv;
+	}
+	int status = 0;
+	unit_assert(waitpid(pid, &status, 0) == pid);
+	unit_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	coro_bus_channel_close(bus, to_child);
+	coro_bus_channel_close(bus, to_parent);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_shared_channel_close_write(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_shared(bus, 16);
+	unit_assert(c1 >= 0);
+
+	const unsigned data_count = 10000;
+	pid_t pid = fork();
+	unit_assert(pid >= 0);
+	if (pid == 0) {
+		for (unsigned i = 0; i < data_count; ++i) {
+			if (coro_bus_send(bus, c1, i) != 0)
+				_exit(1);
+		}
+		if (coro_bus_channel_close_write(bus, c1) != 0)
+			_exit(1);
+		_exit(0);
+	}
+
+	unit_msg("drain everything the child sent before the close");
+	unsigned next = 0;
+	unsigned data = 0;
+	while (coro_bus_recv(bus, c1, &data) == 0)
+		unit_assert(data == next++);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_EOF);
+	unit_assert(next == data_count);
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CLOSED);
+	int status = 0;
+	unit_assert(waitpid(pid, &status, 0) == pid);
+	unit_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_shared_channel_close_write_by_receiver(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("close while the child keeps sending, nothing is lost");
+	for (unsigned round = 0; round < 50; ++round) {
+		int c1 = coro_bus_channel_open_shared(bus, 16);
+		unit_assert(c1 >= 0);
+		int back = coro_bus_channel_open_shared(bus, 1);
+		unit_assert(back >= 0);
+		pid_t pid = fork();
+		unit_assert(pid >= 0);
+		if (pid == 0) {
+			/* Report how many sends succeeded. */
+			unsigned sent = 0;
+			while (coro_bus_send(bus, c1, sent) == 0)
+				++sent;
+			if (coro_bus_errno() != CORO_BUS_ERR_CLOSED)
+				_exit(1);
+			_exit(coro_bus_send(bus, back, sent) == 0 ? 0 : 1);
+		}
+		unsigned next = 0;
+		unsigned data = 0;
+		while (next < round * 37) {
+			unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+			unit_assert(data == next++);
+		}
+		unit_assert(coro_bus_channel_close_write(bus, c1) == 0);
+		while (coro_bus_recv_timeout(bus, c1, &data, 5) == 0)
+			unit_assert(data == next++);
+		unit_assert(coro_bus_errno() == CORO_BUS_ERR_EOF);
+		unit_assert(coro_bus_recv(bus, back, &data) == 0);
+		unit_assert(data == next);
+		int status = 0;
+		unit_assert(waitpid(pid, &status, 0) == pid);
+		unit_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		coro_bus_channel_close(bus, back);
+		coro_bus_channel_close(bus, c1);
+	}
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -1626,10 +2201,12 @@ coro_main_f(void *arg)
 	test_send_recv_very_many();
 	test_wakeup_on_close();
 	test_close_non_empty_bus();
+	test_close_write();
 
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_wakeup_handoff();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1638,6 +2215,15 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+
+	test_send_recv_timeout();
+	test_send_recv_vector_timeout();
+
+	test_shared_channel_attach();
+	test_shared_channel_blocking_local();
+	test_shared_channel_fork();
+	test_shared_channel_close_write();
+	test_shared_channel_close_write_by_receiver();
 	return NULL;
 }
 
@@ -5,9 +5,17 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	std::string buffer;
-};
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define PARSER_HAS_SIMD 1
+#else
+#define PARSER_HAS_SIMD 0
+#endif
 
 enum token_type {
 	TOKEN_TYPE_NONE,
@@ -19,18 +27,393 @@ enum token_type {
 	TOKEN_TYPE_OUT_NEW,
 	TOKEN_TYPE_OUT_APPEND,
 	TOKEN_TYPE_BACKGROUND,
+	TOKEN_TYPE_IN,
+	TOKEN_TYPE_IN_TEXT,
+	TOKEN_TYPE_HEREDOC,
+};
+
+/**
+ * Where the tokenizer stopped when the input ended in the middle of
+ * a token. The next input continues from there.
+ */
+enum token_state {
+	/** Between the tokens. */
+	TOKEN_STATE_NONE,
+	/** Inside a text, maybe quoted. */
+	TOKEN_STATE_TEXT,
+	/** Right after a backslash. */
+	TOKEN_STATE_ESCAPE,
+	/** After & | > or <, which might be repeated. */
+	TOKEN_STATE_OPERATOR,
+	TOKEN_STATE_COMMENT,
+	/** After $, which might start an expansion. */
+	TOKEN_STATE_DOLLAR,
+	/** Inside $(...). */
+	TOKEN_STATE_EXPANSION,
+	/** Inside the name of $NAME or ${NAME}. */
+	TOKEN_STATE_VARIABLE,
+};
+
+/** Expansion found in a token. */
+struct token_expansion {
+	enum expansion_type type;
+	/** Offset in the token text where the output goes. */
+	uint32_t pos;
+	/**
+	 * The command or the variable name is [begin, end) of the
+	 * token's expansion text.
+	 */
+	uint32_t begin;
+	uint32_t end;
+	bool is_quoted;
 };
 
 struct token {
+	/** TOKEN_TYPE_NONE until the token is finished. */
 	enum token_type type = TOKEN_TYPE_NONE;
-	std::string data;
+	/**
+	 * Text of the token. Points right into the parser buffer when
+	 * the token is written as is, or into @a storage when quotes or
+	 * escapes had to be cut out of it.
+	 */
+	std::string_view data;
+	std::string storage;
+	bool is_owned = false;
+	enum token_state state = TOKEN_STATE_NONE;
+	/** The open quote of a not finished token, or 0. */
+	char quote = 0;
+	/** The operator byte in TOKEN_STATE_OPERATOR. */
+	char op = 0;
+	/** How many times the operator byte is already read. */
+	uint8_t op_len = 0;
+	std::vector<token_expansion> expansions;
+	/** Commands and names of the expansions, one after another. */
+	std::string expansion_text;
+	/** Open parentheses of the expansion being scanned. */
+	uint32_t depth = 0;
+	/** Quote inside the expansion being scanned, or 0. */
+	char inner_quote = 0;
+	bool is_inner_escape = false;
+	/** The variable being scanned is ${NAME}. */
+	bool is_braced = false;
+	/** A ${...} with not a name inside was found in the token. */
+	bool is_bad_substitution = false;
+};
+
+enum {
+	PARSER_ARENA_MIN_BLOCK_SIZE = 4096,
+};
+
+/**
+ * Bump allocator for the strings of a command line. Everything is
+ * freed at once by a reset, and the blocks are kept for the next
+ * line.
+ */
+struct parser_arena {
+	std::vector<char *> blocks;
+	std::vector<size_t> sizes;
+	/** Index of the block being filled. */
+	size_t block = 0;
+	/** Bytes used in that block. */
+	size_t used = 0;
+};
+
+static void
+parser_arena_reset(struct parser_arena *a)
+{
+	a->block = 0;
+	a->used = 0;
+}
+
+static char *
+parser_arena_alloc(struct parser_arena *a, size_t size)
+{
+	while (a->block < a->blocks.size()) {
+		if (a->sizes[a->block] - a->used >= size) {
+			char *res = a->blocks[a->block] + a->used;
+			a->used += size;
+			return res;
+		}
+		++a->block;
+		a->used = 0;
+	}
+	size_t block_size = PARSER_ARENA_MIN_BLOCK_SIZE;
+	if (!a->sizes.empty())
+		block_size = a->sizes.back() * 2;
+	if (block_size < size)
+		block_size = size;
+	a->blocks.push_back(new char[block_size]);
+	a->sizes.push_back(block_size);
+	a->block = a->blocks.size() - 1;
+	a->used = size;
+	return a->blocks.back();
+}
+
+static void
+parser_arena_destroy(struct parser_arena *a)
+{
+	for (char *b : a->blocks)
+		delete[] b;
+}
+
+/** Copy the string into the arena, zero-terminated. */
+static std::string_view
+parser_arena_strdup(struct parser_arena *a, std::string_view str)
+{
+	char *res = parser_arena_alloc(a, str.size() + 1);
+	if (!str.empty())
+		memcpy(res, str.data(), str.size());
+	res[str.size()] = 0;
+	return std::string_view(res, str.size());
+}
+
+/** What the next token of a not finished line can be. */
+enum parser_state {
+	/** Commands and operators between them. */
+	PARSER_STATE_EXPRS,
+	/** The file name after > or >>. */
+	PARSER_STATE_OUT_FILE,
+	/** After the output file only & or the line end can follow. */
+	PARSER_STATE_AFTER_OUT_FILE,
+	/** After & only the line end can follow. */
+	PARSER_STATE_AFTER_BACKGROUND,
+	/** The file name after <, the word after <<<, or the heredoc end. */
+	PARSER_STATE_IN_SOURCE,
+	/** Raw lines of a heredoc, up to its end line. */
+	PARSER_STATE_HEREDOC,
+	/** The line is wrong and is skipped until its end. */
+	PARSER_STATE_SKIP,
+};
+
+struct parser {
+	/** Fed data. The bytes before @a pos are already parsed. */
+	std::string buffer;
+	/**
+	 * Caller's memory given to parser_feed_ref(). While not empty it
+	 * is parsed in place instead of the buffer, which is then empty.
+	 */
+	std::string_view ref;
+	/** Offset of the first not yet parsed byte in the input. */
+	size_t pos = 0;
+	/** Bytes parsed since the creation. */
+	uint64_t consumed = 0;
+	/**
+	 * Not popped yet records of parser_feed_compiled(). They go
+	 * before the fed text.
+	 */
+	std::string_view compiled;
+	/*
+	 * The last popped line and its memory. The arrays are flat and
+	 * keep their capacity between the lines.
+	 */
+	struct command_line line;
+	struct parser_arena arena;
+	std::vector<expr> exprs;
+	std::vector<command> cmds;
+	std::vector<std::string_view> args;
+	std::vector<expansion> expansions;
+	/** Reused to keep the capacity of its storage. */
+	struct token token;
+	/*
+	 * The line being parsed is kept between the calls, so the
+	 * input is consumed token by token and never parsed twice.
+	 */
+	bool is_in_line = false;
+	enum parser_state state = PARSER_STATE_EXPRS;
+	/** The error to return when the skipped line ends. */
+	enum parser_error skip_error = PARSER_ERR_NONE;
+	/**
+	 * The redirect which is waiting for its word. In a skipped line
+	 * it is the previous token, to find a heredoc there.
+	 */
+	enum token_type in_token = TOKEN_TYPE_NONE;
+	/** The line has a heredoc, read after the line end. */
+	bool is_heredoc = false;
+	/** The end line of the heredoc. */
+	std::string heredoc_end;
+	/**
+	 * The heredoc text read so far, or the here-string with its new
+	 * line. Its last line is not finished yet from @a heredoc_line.
+	 */
+	std::string heredoc;
+	size_t heredoc_line = 0;
 };
 
 static void
 token_reset(struct token *t)
 {
-	t->data.clear();
+	t->data = std::string_view();
+	t->storage.clear();
+	t->is_owned = false;
 	t->type = TOKEN_TYPE_NONE;
+	t->state = TOKEN_STATE_NONE;
+	t->quote = 0;
+	t->op = 0;
+	t->op_len = 0;
+	t->expansions.clear();
+	t->expansion_text.clear();
+	t->is_bad_substitution = false;
+}
+
+/**
+ * Add a piece of the input to the token text. The first piece is
+ * only referenced. The text is copied only when the token turns
+ * out to consist of several pieces.
+ */
+static void
+token_append(struct token *t, const char *begin, const char *end)
+{
+	if (begin == end)
+		return;
+	if (t->data.empty() && !t->is_owned) {
+		t->data = std::string_view(begin, end - begin);
+		return;
+	}
+	if (!t->is_owned) {
+		t->storage.assign(t->data.data(), t->data.size());
+		t->is_owned = true;
+	}
+	t->storage.append(begin, end - begin);
+	t->data = t->storage;
+}
+
+/**
+ * Remember the not finished token. Its text is copied, since the
+ * input it came from is consumed.
+ */
+static void
+token_suspend(struct token *t, const char *seg, const char *end,
+	enum token_state state)
+{
+	token_append(t, seg, end);
+	if (!t->is_owned) {
+		t->storage.assign(t->data.data(), t->data.size());
+		t->is_owned = true;
+		t->data = t->storage;
+	}
+	t->state = state;
+}
+
+/**
+ * Whether the token has no text, including the not added yet, and
+ * no expansions.
+ */
+static inline bool
+token_is_empty(const struct token *t, const char *seg, const char *pos)
+{
+	return t->data.empty() && seg == pos && t->expansions.empty();
+}
+
+static void
+token_expansion_start(struct token *t, enum expansion_type type,
+	bool is_quoted)
+{
+	token_expansion e;
+	e.type = type;
+	e.pos = t->data.size();
+	e.begin = e.end = t->expansion_text.size();
+	e.is_quoted = is_quoted;
+	t->expansions.push_back(e);
+	t->depth = 1;
+	t->inner_quote = 0;
+	t->is_inner_escape = false;
+}
+
+/**
+ * Scan the command of an expansion up to its closing parenthesis.
+ * Quotes and escapes inside are skipped as a whole. Returns the
+ * position after the parenthesis, or NULL if the input ended first.
+ */
+static const char *
+token_scan_expansion(struct token *t, const char *pos, const char *end)
+{
+	const char *seg = pos;
+	for (; pos < end; ++pos) {
+		char c = *pos;
+		if (t->is_inner_escape) {
+			t->is_inner_escape = false;
+			continue;
+		}
+		if (c == '\\' && t->inner_quote != '\'') {
+			t->is_inner_escape = true;
+			continue;
+		}
+		if (t->inner_quote != 0) {
+			if (c == t->inner_quote)
+				t->inner_quote = 0;
+			continue;
+		}
+		if (c == '\'' || c == '"') {
+			t->inner_quote = c;
+		} else if (c == '(') {
+			++t->depth;
+		} else if (c == ')' && --t->depth == 0) {
+			t->expansion_text.append(seg, pos - seg);
+			t->expansions.back().end = t->expansion_text.size();
+			return pos + 1;
+		}
+	}
+	t->expansion_text.append(seg, pos - seg);
+	return NULL;
+}
+
+static inline bool
+is_name_start(char c)
+{
+	return isalpha((unsigned char)c) || c == '_';
+}
+
+static inline bool
+is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+/** Whether $ followed by the byte starts an expansion. */
+static inline bool
+is_expansion_start(char c)
+{
+	return c == '(' || c == '{' || c == '?' || is_name_start(c);
+}
+
+/**
+ * Scan the name of a variable, up to } if it is braced, or while
+ * the name bytes go otherwise. Returns the position after the name,
+ * or NULL if the input ended first. A braced one can only have a
+ * name or ? inside. Otherwise the token is marked bad, and the
+ * scan stops at the wrong byte, so a line end is still seen.
+ */
+static const char *
+token_scan_variable(struct token *t, const char *pos, const char *end)
+{
+	const char *seg = pos;
+	if (t->is_braced) {
+		struct token_expansion &e = t->expansions.back();
+		std::string_view name = std::string_view(t->expansion_text)
+			.substr(e.begin);
+		if (name.empty() && pos < end && *pos == '?') {
+			++pos;
+		} else if (name != "?") {
+			while (pos < end && is_name_char(*pos))
+				++pos;
+		}
+		t->expansion_text.append(seg, pos - seg);
+		if (pos == end)
+			return NULL;
+		e.end = t->expansion_text.size();
+		if (*pos != '}' || e.end == e.begin) {
+			t->is_bad_substitution = true;
+			return pos;
+		}
+		return pos + 1;
+	}
+	while (pos < end && is_name_char(*pos))
+		++pos;
+	t->expansion_text.append(seg, pos - seg);
+	if (pos == end)
+		return NULL;
+	t->expansions.back().end = t->expansion_text.size();
+	return pos;
 }
 
 struct parser *
@@ -39,307 +422,857 @@ parser_new(void)
 	return new parser();
 }
 
+uint64_t
+parser_consumed(const struct parser *p)
+{
+	return p->consumed;
+}
+
+/** All the fed data, either the buffer or the referenced memory. */
+static inline std::string_view
+parser_input(const struct parser *p)
+{
+	return p->ref.empty() ? std::string_view(p->buffer) : p->ref;
+}
+
+static void
+parser_append(struct parser *p, const char *str, size_t len)
+{
+	if (!p->ref.empty()) {
+		/* The referenced memory can go away after this call. */
+		p->buffer.assign(p->ref.data() + p->pos, p->ref.size() - p->pos);
+		p->ref = std::string_view();
+		p->pos = 0;
+	}
+	/*
+	 * Drop the parsed prefix only when it is not smaller than the
+	 * rest. Then each byte is moved at most once per being parsed,
+	 * and consuming a line is O(1) amortized.
+	 */
+	if (p->pos > 0 && p->pos >= p->buffer.size() - p->pos) {
+		p->buffer.erase(0, p->pos);
+		p->pos = 0;
+	}
+	p->buffer.append(str, len);
+}
+
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
-	p->buffer.append(str, len);
+	parser_append(p, str, len);
+}
+
+void
+parser_feed_ref(struct parser *p, const char *str, size_t len)
+{
+	if (len == 0)
+		return;
+	if (p->pos < parser_input(p).size()) {
+		/* Can't parse a line split between two pieces in place. */
+		parser_append(p, str, len);
+		return;
+	}
+	p->buffer.clear();
+	p->ref = std::string_view(str, len);
+	p->pos = 0;
+}
+
+const char *
+parser_feed_end(struct parser *p)
+{
+	if (!p->compiled.empty() || !p->is_in_line ||
+	    p->state != PARSER_STATE_HEREDOC ||
+	    p->pos < parser_input(p).size())
+		return NULL;
+	/* The end line may only lack its line end. */
+	std::string_view last = std::string_view(p->heredoc).substr(
+		p->heredoc_line);
+	if (last == p->heredoc_end) {
+		parser_append(p, "\n", 1);
+		return NULL;
+	}
+	std::string tail;
+	if (!last.empty())
+		tail.push_back('\n');
+	tail.append(p->heredoc_end);
+	tail.push_back('\n');
+	parser_append(p, tail.data(), tail.size());
+	return p->heredoc_end.c_str();
 }
 
 static void
-parser_consume(struct parser *p, uint32_t size)
+parser_consume(struct parser *p, size_t size)
+{
+	size_t total = parser_input(p).size();
+	assert(total - p->pos >= size);
+	p->pos += size;
+	p->consumed += size;
+	if (p->pos == total) {
+		p->buffer.clear();
+		p->ref = std::string_view();
+		p->pos = 0;
+	}
+}
+
+/*
+ * The scanners below skip the bytes which the tokenizer would just
+ * add to the token, so it looks only at the ones which might end
+ * the token or need processing. A scanner may stop at an ordinary
+ * byte too, it is handled as usual then. But it never skips a
+ * special one.
+ */
+
+enum {
+	/** How many bytes to check one by one before using SIMD. */
+	SCAN_SHORT_SIZE = 8,
+};
+
+/**
+ * Outside of quotes the special bytes are the whitespace, ' " \ &
+ * | > #. The first four are taken together with all the bytes up
+ * to '\'', which catches the control bytes and ! $ % too, but
+ * needs just one comparison.
+ */
+static inline bool
+scan_is_special(char c)
+{
+	return (unsigned char)c <= '\'' || c == '\\' || c == '|' || c == '>' ||
+		c == '<';
+}
+
+#if PARSER_HAS_SIMD
+
+static inline unsigned
+scan_mask_sse2(const char *pos)
 {
-	assert(p->buffer.size() >= size);
-	p->buffer.erase(0, size);
+	__m128i v = _mm_loadu_si128((const __m128i *)pos);
+	__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8('\'')), v);
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+	/* < and > differ only in the bit 1. */
+	__m128i angle = _mm_or_si128(v, _mm_set1_epi8(2));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(angle, _mm_set1_epi8('>')));
+	return _mm_movemask_epi8(m);
 }
 
-static uint32_t
+static inline unsigned
+scan_mask_dquote_sse2(const char *pos)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)pos);
+	__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+	return _mm_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static const char *
+scan_special_avx2(const char *pos, const char *end)
+{
+	const __m256i quote = _mm256_set1_epi8('\'');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i bar = _mm256_set1_epi8('|');
+	const __m256i greater = _mm256_set1_epi8('>');
+	const __m256i angle_bit = _mm256_set1_epi8(2);
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)pos);
+		__m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, quote), v);
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, backslash));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, bar));
+		/* < and > differ only in the bit 1. */
+		__m256i angle = _mm256_or_si256(v, angle_bit);
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(angle, greater));
+		unsigned mask = _mm256_movemask_epi8(m);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+	return pos;
+}
+
+static const bool scan_has_avx2 = __builtin_cpu_supports("avx2");
+
+#endif
+
+/** Find the next byte which is special outside of quotes. */
+static const char *
+scan_special(const char *pos, const char *end)
+{
+	/*
+	 * Most of the tokens are short, and for them setting up the
+	 * vectors costs more than it saves.
+	 */
+	const char *short_end = end - pos > SCAN_SHORT_SIZE ?
+		pos + SCAN_SHORT_SIZE : end;
+	for (; pos < short_end; ++pos) {
+		if (scan_is_special(*pos))
+			return pos;
+	}
+#if PARSER_HAS_SIMD
+	if (scan_has_avx2)
+		pos = scan_special_avx2(pos, end);
+	while (end - pos >= 16) {
+		unsigned mask = scan_mask_sse2(pos);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	while (pos < end && !scan_is_special(*pos))
+		++pos;
+	return pos;
+}
+
+/** Inside double quotes only the quote, backslash and $ matter. */
+static const char *
+scan_special_dquote(const char *pos, const char *end)
+{
+	const char *short_end = end - pos > SCAN_SHORT_SIZE ?
+		pos + SCAN_SHORT_SIZE : end;
+	for (; pos < short_end; ++pos) {
+		if (*pos == '"' || *pos == '\\' || *pos == '$')
+			return pos;
+	}
+#if PARSER_HAS_SIMD
+	while (end - pos >= 16) {
+		unsigned mask = scan_mask_dquote_sse2(pos);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	while (pos < end && *pos != '"' && *pos != '\\' && *pos != '$')
+		++pos;
+	return pos;
+}
+
+/** Find the next byte the tokenizer has to look at. */
+static inline const char *
+scan_next(const char *pos, const char *end, char quote)
+{
+	if (quote == 0)
+		return scan_special(pos, end);
+	if (quote == '"')
+		return scan_special_dquote(pos, end);
+	const char *res = (const char *)memchr(pos, quote, end - pos);
+	return res != NULL ? res : end;
+}
+
+/** Type of a token of @a len same operator bytes. */
+static enum token_type
+token_operator_type(char c, uint32_t len)
+{
+	switch(c) {
+	case '&':
+		return len == 2 ? TOKEN_TYPE_AND : TOKEN_TYPE_BACKGROUND;
+	case '|':
+		return len == 2 ? TOKEN_TYPE_OR : TOKEN_TYPE_PIPE;
+	case '>':
+		return len == 2 ? TOKEN_TYPE_OUT_APPEND : TOKEN_TYPE_OUT_NEW;
+	case '<':
+		if (len == 3)
+			return TOKEN_TYPE_IN_TEXT;
+		return len == 2 ? TOKEN_TYPE_HEREDOC : TOKEN_TYPE_IN;
+	default:
+		assert(false);
+		return TOKEN_TYPE_NONE;
+	}
+}
+
+/**
+ * Continue the operator, whose first @a t->op_len bytes are read.
+ * Only < can be tripled. Returns where the operator ends. If the
+ * input ends before that is clear, the state becomes OPERATOR and
+ * the type stays NONE.
+ */
+static const char *
+token_scan_operator(struct token *t, const char *pos, const char *end)
+{
+	uint32_t max_len = t->op == '<' ? 3 : 2;
+	while (pos < end && t->op_len < max_len && *pos == t->op) {
+		++t->op_len;
+		++pos;
+	}
+	if (pos == end && t->op_len < max_len) {
+		t->state = TOKEN_STATE_OPERATOR;
+		return pos;
+	}
+	t->state = TOKEN_STATE_NONE;
+	t->type = token_operator_type(t->op, t->op_len);
+	return pos;
+}
+
+/**
+ * Parse the next token, or continue the not finished one. Returns
+ * the number of used bytes. When the input ends before the token,
+ * all of it is used and the token type stays TOKEN_TYPE_NONE.
+ */
+static size_t
 parse_token(const char *pos, const char *end, struct token *out)
 {
-	token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
+	char quote = out->quote;
+	/* Start of the text not added to the token yet. */
+	const char *seg = pos;
+	char c;
+	switch (out->state) {
+	case TOKEN_STATE_NONE:
+		token_reset(out);
+		quote = 0;
+		while (pos < end) {
+			if (!isspace(*pos))
+				break;
+			if (*pos == '\n') {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
+			++pos;
+		}
+		seg = pos;
+		break;
+	case TOKEN_STATE_TEXT:
+		break;
+	case TOKEN_STATE_ESCAPE:
+		c = *pos;
+		if (c == '\n') {
+			++pos;
+			seg = pos;
 			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
 		}
+		/* In double quotes most of the escapes keep the backslash. */
+		if (quote == '"' && c != '\\' && c != '"' && c != '$') {
+			static const char backslash = '\\';
+			token_append(out, &backslash, &backslash + 1);
+		}
+		seg = pos;
 		++pos;
+		break;
+	case TOKEN_STATE_OPERATOR:
+		return token_scan_operator(out, pos, end) - begin;
+	case TOKEN_STATE_COMMENT:
+		pos = (const char *)memchr(pos, '\n', end - pos);
+		if (pos == NULL)
+			return end - begin;
+		out->state = TOKEN_STATE_NONE;
+		out->type = TOKEN_TYPE_NEW_LINE;
+		return pos + 1 - begin;
+	case TOKEN_STATE_DOLLAR:
+	dollar:
+		c = *pos;
+		if (c == '(') {
+			token_expansion_start(out, EXPANSION_TYPE_COMMAND,
+				quote != 0);
+			++pos;
+			goto expansion;
+		}
+		if (!is_expansion_start(c)) {
+			static const char dollar = '$';
+			token_append(out, &dollar, &dollar + 1);
+			seg = pos;
+			break;
+		}
+		token_expansion_start(out, EXPANSION_TYPE_VARIABLE, quote != 0);
+		out->is_braced = c == '{';
+		if (c == '?') {
+			out->expansion_text.push_back(c);
+			out->expansions.back().end = out->expansion_text.size();
+			++pos;
+			seg = pos;
+			break;
+		}
+		if (out->is_braced)
+			++pos;
+		goto variable;
+	case TOKEN_STATE_EXPANSION:
+	expansion:
+		pos = token_scan_expansion(out, pos, end);
+		if (pos == NULL) {
+			out->quote = quote;
+			token_suspend(out, end, end, TOKEN_STATE_EXPANSION);
+			return end - begin;
+		}
+		seg = pos;
+		break;
+	case TOKEN_STATE_VARIABLE:
+	variable:
+		pos = token_scan_variable(out, pos, end);
+		if (pos == NULL) {
+			out->quote = quote;
+			token_suspend(out, end, end, TOKEN_STATE_VARIABLE);
+			return end - begin;
+		}
+		seg = pos;
+		break;
 	}
-	char quote = 0;
-	while (pos < end) {
-		char c = *pos;
+	if (pos == end) {
+		if (out->state == TOKEN_STATE_NONE)
+			return end - begin;
+		out->quote = quote;
+		token_suspend(out, seg, end, TOKEN_STATE_TEXT);
+		return end - begin;
+	}
+	out->state = TOKEN_STATE_NONE;
+	while ((pos = scan_next(pos, end, quote)) < end) {
+		c = *pos;
 		switch(c) {
 		case '\'':
 		case '"':
 			if (quote == 0) {
+				token_append(out, seg, pos);
 				quote = c;
 				++pos;
-				if (pos == end)
-					return 0;
+				seg = pos;
 				continue;
 			}
 			if (quote != c)
-				goto append_and_next;
+				goto next;
+			token_append(out, seg, pos);
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\\':
 			if (quote == '\'')
-				goto append_and_next;
+				goto next;
 			if (quote == '"') {
 				++pos;
-				if (pos == end)
-					return 0;
+				if (pos == end) {
+					out->quote = quote;
+					token_suspend(out, seg, pos - 1,
+						TOKEN_STATE_ESCAPE);
+					return end - begin;
+				}
 				c = *pos;
 				switch (c)
 				{
 				case '\\':
-					goto append_and_next;
+				case '"':
+				case '$':
+					/* Only the backslash is cut out. */
+					token_append(out, seg, pos - 1);
+					seg = pos;
+					goto next;
 				case '\n':
+					token_append(out, seg, pos - 1);
 					++pos;
+					seg = pos;
 					continue;
-				case '"':
-					goto append_and_next;
 				default:
-					break;
+					/* The backslash stays in the text. */
+					goto next;
 				}
-				out->data += '\\';
-				goto append_and_next;
 			}
 			assert(quote == 0);
+			token_append(out, seg, pos);
 			++pos;
-			if (pos == end)
-				return 0;
+			if (pos == end) {
+				out->quote = quote;
+				token_suspend(out, pos, pos, TOKEN_STATE_ESCAPE);
+				return end - begin;
+			}
+			seg = pos;
 			c = *pos;
 			if (c == '\n') {
 				++pos;
+				seg = pos;
 				continue;
 			}
-			goto append_and_next;
+			goto next;
+		case '$':
+			if (quote == '\'')
+				goto next;
+			if (pos + 1 == end) {
+				token_append(out, seg, pos);
+				out->quote = quote;
+				token_suspend(out, end, end, TOKEN_STATE_DOLLAR);
+				return end - begin;
+			}
+			if (!is_expansion_start(pos[1]))
+				goto next;
+			token_append(out, seg, pos);
+			++pos;
+			/* Continue as if the input was split after the $. */
+			out->state = TOKEN_STATE_DOLLAR;
+			goto dollar;
 		case '&':
 		case '|':
 		case '>':
+		case '<':
 			if (quote != 0)
-				goto append_and_next;
-			if (!out->data.empty()) {
+				goto next;
+			if (!token_is_empty(out, seg, pos)) {
+				token_append(out, seg, pos);
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
-			++pos;
-			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
-				default:
-					assert(false);
-					break;
-				}
-			}
-			return pos - begin;
+			out->op = c;
+			out->op_len = 1;
+			return token_scan_operator(out, pos + 1, end) - begin;
 		case ' ':
 		case '\t':
 		case '\r':
 			if (quote != 0)
-				goto append_and_next;
-			assert(!out->data.empty());
+				goto next;
+			assert(!token_is_empty(out, seg, pos));
+			token_append(out, seg, pos);
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
-				goto append_and_next;
-			assert(!out->data.empty());
+				goto next;
+			assert(!token_is_empty(out, seg, pos));
+			token_append(out, seg, pos);
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
 			if (quote != 0)
-				goto append_and_next;
-			if (!out->data.empty()) {
+				goto next;
+			if (!token_is_empty(out, seg, pos)) {
+				token_append(out, seg, pos);
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
+			pos = (const char *)memchr(pos, '\n', end - pos);
+			if (pos == NULL) {
+				out->state = TOKEN_STATE_COMMENT;
+				return end - begin;
 			}
-			return 0;
+			out->type = TOKEN_TYPE_NEW_LINE;
+			return pos + 1 - begin;
 		default:
-			goto append_and_next;
+			goto next;
 		}
-	append_and_next:
-		out->data += c;
+	next:
 		++pos;
 	}
-	return 0;
+	out->quote = quote;
+	token_suspend(out, seg, end, TOKEN_STATE_TEXT);
+	return end - begin;
 }
 
+/** Forget the previous line, keeping its memory. */
+static void
+parser_line_reset(struct parser *p)
+{
+	p->line = command_line();
+	p->exprs.clear();
+	p->cmds.clear();
+	p->args.clear();
+	p->expansions.clear();
+	parser_arena_reset(&p->arena);
+}
+
+/**
+ * Point the line to its arrays. It is done only in the end, since
+ * the arrays might be relocated while growing.
+ */
+static void
+parser_line_finish(struct parser *p)
+{
+	struct command_line *line = &p->line;
+	line->exprs.data = p->exprs.data();
+	line->exprs.count = p->exprs.size();
+	struct command *cmd = p->cmds.data();
+	std::string_view *args = p->args.data();
+	struct expansion *expansions = p->expansions.data();
+	for (expr &e : p->exprs) {
+		if (e.type != EXPR_TYPE_COMMAND)
+			continue;
+		e.cmd = cmd;
+		cmd->args.data = args;
+		args += cmd->args.count;
+		cmd->expansions.data = expansions;
+		expansions += cmd->expansions.count;
+		++cmd;
+	}
+	assert(cmd == p->cmds.data() + p->cmds.size());
+	assert(args == p->args.data() + p->args.size());
+	assert(expansions == p->expansions.data() + p->expansions.size());
+}
+
+/** Add the expansions of the token to the word of the last command. */
+static void
+parser_add_expansions(struct parser *p, const struct token *t, uint32_t word)
+{
+	std::string_view text = t->expansion_text;
+	for (const token_expansion &te : t->expansions) {
+		expansion e;
+		e.word = word;
+		e.pos = te.pos;
+		e.text = parser_arena_strdup(&p->arena,
+			text.substr(te.begin, te.end - te.begin));
+		e.type = te.type;
+		e.is_quoted = te.is_quoted;
+		p->expansions.push_back(e);
+		p->cmds.back().expansions.count++;
+	}
+}
+
+/** Check the left side of a pipe, && or ||. */
+static enum parser_error
+parser_check_operator(const std::vector<expr> &exprs, enum parser_error no_arg,
+	enum parser_error bad_arg)
+{
+	if (exprs.empty())
+		return no_arg;
+	if (exprs.back().type != EXPR_TYPE_COMMAND)
+		return bad_arg;
+	return PARSER_ERR_NONE;
+}
+
+static enum parser_error
+parser_pop_compiled(struct parser *p, struct command_line **out);
+
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = new command_line();
-	char *pos = p->buffer.data();
+	if (!p->compiled.empty())
+		return parser_pop_compiled(p, out);
+	if (!p->is_in_line) {
+		parser_line_reset(p);
+		p->is_in_line = true;
+		p->state = PARSER_STATE_EXPRS;
+		p->skip_error = PARSER_ERR_NONE;
+		p->in_token = TOKEN_TYPE_NONE;
+		p->is_heredoc = false;
+	}
+	struct command_line *line = &p->line;
+	std::vector<expr> &exprs = p->exprs;
+	std::string_view input = parser_input(p);
+	const char *pos = input.data() + p->pos;
 	const char *begin = pos;
-	char *end = pos + p->buffer.size();
-	struct token token;
+	const char *end = input.data() + input.size();
+	struct token &token = p->token;
 	enum parser_error res = PARSER_ERR_NONE;
 
+parse_tokens:
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+		if (p->state == PARSER_STATE_HEREDOC) {
+			/*
+			 * The lines are taken as is. A not finished line
+			 * is kept in the text, so it isn't scanned again.
+			 */
+			const char *eol = (const char *)memchr(pos, '\n',
+				end - pos);
+			p->heredoc.append(pos, (eol != NULL ? eol : end) - pos);
+			if (eol == NULL) {
+				pos = end;
+				break;
+			}
+			pos = eol + 1;
+			if (std::string_view(p->heredoc).substr(p->heredoc_line) ==
+			    p->heredoc_end) {
+				if (p->skip_error != PARSER_ERR_NONE)
+					goto finish_skipped_line;
+				p->heredoc.resize(p->heredoc_line);
+				line->in_source = parser_arena_strdup(&p->arena,
+					p->heredoc);
+				goto finish_line;
+			}
+			p->heredoc.push_back('\n');
+			p->heredoc_line = p->heredoc.size();
+			continue;
+		}
+		pos += parse_token(pos, end, &token);
+		if (token.type == TOKEN_TYPE_NONE) {
+			assert(pos == end);
+			break;
+		}
+		if (token.is_bad_substitution &&
+		    p->state != PARSER_STATE_SKIP) {
+			res = PARSER_ERR_BAD_SUBSTITUTION;
+			goto skip_line;
+		}
 		expr e;
+		switch (p->state) {
+		case PARSER_STATE_EXPRS:
+			break;
+		case PARSER_STATE_OUT_FILE:
+			if (token.type != TOKEN_TYPE_STR ||
+			    !token.expansions.empty()) {
+				res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+				goto skip_line;
+			}
+			line->out_file = parser_arena_strdup(&p->arena, token.data);
+			p->state = PARSER_STATE_AFTER_OUT_FILE;
+			continue;
+		case PARSER_STATE_IN_SOURCE:
+			if (token.type != TOKEN_TYPE_STR ||
+			    !token.expansions.empty()) {
+				res = PARSER_ERR_INPUT_REDIRECT_BAD_ARG;
+				goto skip_line;
+			}
+			if (p->in_token == TOKEN_TYPE_HEREDOC) {
+				p->heredoc_end.assign(token.data);
+				p->is_heredoc = true;
+			} else if (p->in_token == TOKEN_TYPE_IN_TEXT) {
+				p->heredoc.assign(token.data);
+				p->heredoc.push_back('\n');
+				line->in_source = parser_arena_strdup(&p->arena,
+					p->heredoc);
+			} else {
+				line->in_source = parser_arena_strdup(&p->arena,
+					token.data);
+			}
+			p->state = PARSER_STATE_EXPRS;
+			continue;
+		case PARSER_STATE_HEREDOC:
+			assert(false);
+			break;
+		case PARSER_STATE_AFTER_OUT_FILE:
+			if (token.type == TOKEN_TYPE_BACKGROUND) {
+				line->is_background = true;
+				p->state = PARSER_STATE_AFTER_BACKGROUND;
+				continue;
+			}
+			if (token.type == TOKEN_TYPE_NEW_LINE)
+				goto finish_line;
+			res = PARSER_ERR_TOO_LATE_ARGUMENTS;
+			goto skip_line;
+		case PARSER_STATE_AFTER_BACKGROUND:
+			if (token.type == TOKEN_TYPE_NEW_LINE)
+				goto finish_line;
+			res = PARSER_ERR_TOO_LATE_ARGUMENTS;
+			goto skip_line;
+		case PARSER_STATE_SKIP:
+			/*
+			 * The wrong line can't be executed but can't just
+			 * crash here because of that.
+			 */
+			if (token.type != TOKEN_TYPE_NEW_LINE) {
+				/* Its heredoc is skipped too. */
+				if (p->in_token == TOKEN_TYPE_HEREDOC &&
+				    token.type == TOKEN_TYPE_STR) {
+					p->heredoc_end.assign(token.data);
+					p->is_heredoc = true;
+				}
+				p->in_token = token.type;
+				continue;
+			}
+			if (p->is_heredoc)
+				goto start_heredoc;
+			goto finish_skipped_line;
+		}
 		switch(token.type) {
 		case TOKEN_TYPE_STR:
-			if (!line->exprs.empty() && line->exprs.back().type == EXPR_TYPE_COMMAND) {
-				line->exprs.back().cmd->args.emplace_back(std::move(token.data));
+			if (!exprs.empty() && exprs.back().type == EXPR_TYPE_COMMAND) {
+				p->args.push_back(parser_arena_strdup(&p->arena,
+					token.data));
+				uint32_t word = ++p->cmds.back().args.count;
+				parser_add_expansions(p, &token, word);
 				continue;
 			}
 			e.type = EXPR_TYPE_COMMAND;
-			e.cmd.emplace();
-			e.cmd->exe = std::move(token.data);
-			line->exprs.emplace_back(std::move(e));
+			p->cmds.emplace_back();
+			p->cmds.back().exe = parser_arena_strdup(&p->arena,
+				token.data);
+			parser_add_expansions(p, &token, 0);
+			exprs.push_back(e);
 			continue;
 		case TOKEN_TYPE_NEW_LINE:
 			/* Skip new lines. */
-			if (line->exprs.empty())
+			if (exprs.empty() && line->in_type == INPUT_TYPE_STDIN)
 				continue;
-			goto close_and_return;
+			goto finish_line;
 		case TOKEN_TYPE_PIPE:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
+			res = parser_check_operator(exprs,
+				PARSER_ERR_PIPE_WITH_NO_LEFT_ARG,
+				PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND);
+			if (res != PARSER_ERR_NONE)
+				goto skip_line;
 			e.type = EXPR_TYPE_PIPE;
-			line->exprs.emplace_back(std::move(e));
+			exprs.push_back(e);
 			continue;
 		case TOKEN_TYPE_AND:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
+			res = parser_check_operator(exprs,
+				PARSER_ERR_AND_WITH_NO_LEFT_ARG,
+				PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND);
+			if (res != PARSER_ERR_NONE)
+				goto skip_line;
 			e.type = EXPR_TYPE_AND;
-			line->exprs.emplace_back(std::move(e));
+			exprs.push_back(e);
 			continue;
 		case TOKEN_TYPE_OR:
-			if (line->exprs.empty()) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
+			res = parser_check_operator(exprs,
+				PARSER_ERR_OR_WITH_NO_LEFT_ARG,
+				PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND);
+			if (res != PARSER_ERR_NONE)
+				goto skip_line;
 			e.type = EXPR_TYPE_OR;
-			line->exprs.emplace_back(std::move(e));
+			exprs.push_back(e);
 			continue;
 		case TOKEN_TYPE_OUT_NEW:
+			line->out_type = OUTPUT_TYPE_FILE_NEW;
+			p->state = PARSER_STATE_OUT_FILE;
+			continue;
 		case TOKEN_TYPE_OUT_APPEND:
+			line->out_type = OUTPUT_TYPE_FILE_APPEND;
+			p->state = PARSER_STATE_OUT_FILE;
+			continue;
 		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
+			line->is_background = true;
+			p->state = PARSER_STATE_AFTER_BACKGROUND;
+			continue;
+		case TOKEN_TYPE_IN:
+		case TOKEN_TYPE_IN_TEXT:
+		case TOKEN_TYPE_HEREDOC:
+			/* Only the first command reads the input. */
+			if (line->in_type != INPUT_TYPE_STDIN || exprs.size() > 1) {
+				res = PARSER_ERR_INPUT_REDIRECT_NOT_FIRST;
+				goto skip_line;
+			}
+			line->in_type = token.type == TOKEN_TYPE_IN ?
+				INPUT_TYPE_FILE : INPUT_TYPE_TEXT;
+			p->in_token = token.type;
+			p->state = PARSER_STATE_IN_SOURCE;
+			continue;
 		default:
 			assert(false);
 		}
 	}
+	/* The rest is kept in the parser state. */
+	parser_consume(p, pos - begin);
 	goto return_no_line;
 
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
-		}
-		line->out_file = std::move(token.data);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(!line->exprs.empty());
-		parser_consume(p, pos - begin);
-		if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
-		}
-		*out = line;
-		return PARSER_ERR_NONE;
-	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
+skip_line:
 	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
+	 * Skip the whole line, including the next line end. The error
+	 * is returned when it is found.
 	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
-		}
-	}
+	p->state = PARSER_STATE_SKIP;
+	p->skip_error = res;
+	p->in_token = token.type;
 	res = PARSER_ERR_NONE;
+	goto parse_tokens;
+
+start_heredoc:
+	/* The line goes on with the heredoc lines. */
+	p->is_heredoc = false;
+	p->state = PARSER_STATE_HEREDOC;
+	p->heredoc.clear();
+	p->heredoc_line = 0;
+	goto parse_tokens;
+
+finish_skipped_line:
+	parser_consume(p, pos - begin);
+	p->is_in_line = false;
+	res = p->skip_error;
 	goto return_no_line;
 
+finish_line:
+	if (p->is_heredoc)
+		goto start_heredoc;
+	parser_consume(p, pos - begin);
+	p->is_in_line = false;
+	/* A line can also have nothing but an input redirect. */
+	if (exprs.empty() || exprs.back().type != EXPR_TYPE_COMMAND) {
+		res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		goto return_no_line;
+	}
+	parser_line_finish(p);
+	*out = line;
+	return PARSER_ERR_NONE;
+
 return_no_line:
-	delete line;
 	*out = NULL;
 	return res;
 }
@@ -347,5 +1280,416 @@ return_no_line:
 void
 parser_delete(struct parser *p)
 {
+	parser_arena_destroy(&p->arena);
 	delete p;
 }
+
+/** Bump @a pos by @a count objects of type T placed there. */
+template <typename T>
+static T *
+command_line_place(char *&pos, size_t count)
+{
+	T *res = reinterpret_cast<T *>(pos);
+	for (size_t i = 0; i < count; ++i)
+		new (res + i) T();
+	pos += sizeof(T) * count;
+	return res;
+}
+
+static std::string_view
+command_line_place_str(char *&pos, std::string_view str)
+{
+	if (!str.empty())
+		memcpy(pos, str.data(), str.size());
+	pos[str.size()] = 0;
+	std::string_view res(pos, str.size());
+	pos += str.size() + 1;
+	return res;
+}
+
+struct command_line *
+command_line_dup(const struct command_line *line)
+{
+	/*
+	 * The layout is: the line, the exprs, the commands, the args, the
+	 * expansions, and then the strings. The structs are all 8-byte
+	 * aligned, so each array stays aligned after the previous one.
+	 */
+	static_assert(alignof(struct expr) <= alignof(struct command_line) &&
+		alignof(struct command) <= alignof(struct command_line) &&
+		alignof(std::string_view) <= alignof(struct command_line) &&
+		alignof(struct expansion) <= alignof(struct command_line) &&
+		sizeof(struct expansion) % alignof(struct command_line) == 0,
+		"no padding between the arrays");
+	size_t cmd_count = 0;
+	size_t arg_count = 0;
+	size_t expansion_count = 0;
+	size_t str_size = line->out_file.size() + 1 +
+		line->in_source.size() + 1;
+	for (const struct expr &e : line->exprs) {
+		if (e.type != EXPR_TYPE_COMMAND)
+			continue;
+		++cmd_count;
+		arg_count += e.cmd->args.size();
+		expansion_count += e.cmd->expansions.size();
+		str_size += e.cmd->exe.size() + 1;
+		for (std::string_view arg : e.cmd->args)
+			str_size += arg.size() + 1;
+		for (const struct expansion &x : e.cmd->expansions)
+			str_size += x.text.size() + 1;
+	}
+	size_t size = sizeof(struct command_line) +
+		sizeof(struct expr) * line->exprs.size() +
+		sizeof(struct command) * cmd_count +
+		sizeof(std::string_view) * arg_count +
+		sizeof(struct expansion) * expansion_count + str_size;
+	char *pos = new char[size];
+
+	struct command_line *res = command_line_place<struct command_line>(pos, 1);
+	res->out_type = line->out_type;
+	res->in_type = line->in_type;
+	res->is_background = line->is_background;
+	res->exprs.data = command_line_place<struct expr>(pos, line->exprs.size());
+	res->exprs.count = line->exprs.size();
+	struct command *cmd = command_line_place<struct command>(pos, cmd_count);
+	std::string_view *arg = command_line_place<std::string_view>(pos, arg_count);
+	struct expansion *expansion =
+		command_line_place<struct expansion>(pos, expansion_count);
+	for (uint32_t i = 0; i < line->exprs.size(); ++i) {
+		const struct expr &src = line->exprs[i];
+		struct expr &dst = res->exprs[i];
+		dst.type = src.type;
+		if (src.type != EXPR_TYPE_COMMAND)
+			continue;
+		dst.cmd = cmd++;
+		dst.cmd->exe = command_line_place_str(pos, src.cmd->exe);
+		dst.cmd->args.data = arg;
+		dst.cmd->args.count = src.cmd->args.size();
+		for (std::string_view a : src.cmd->args)
+			*arg++ = command_line_place_str(pos, a);
+		dst.cmd->expansions.data = expansion;
+		dst.cmd->expansions.count = src.cmd->expansions.size();
+		for (const struct expansion &x : src.cmd->expansions) {
+			*expansion = x;
+			expansion->text = command_line_place_str(pos, x.text);
+			++expansion;
+		}
+	}
+	res->out_file = command_line_place_str(pos, line->out_file);
+	res->in_source = command_line_place_str(pos, line->in_source);
+	return res;
+}
+
+void
+command_line_delete(struct command_line *line)
+{
+	/* All the parts are trivially destructible. */
+	delete[] reinterpret_cast<char *>(line);
+}
+
+/*
+ * A compiled script is a header and then one record per popped line
+ * or error, all in the host byte order:
+ *
+ *   record: u32 size of its text, u8 error, and if it is
+ *           PARSER_ERR_NONE then a line
+ *   line:   u8 out_type, u8 is_background, [str out_file],
+ *           u8 in_type, [str in_source],
+ *           u32 expr_count, expr_count * expr
+ *   expr:   u8 type, and for a command: str exe, u32 argc, argc * str,
+ *           u32 expansion_count, expansion_count * expansion
+ *   expansion: u8 type, u32 word, u32 pos, u8 is_quoted, str text
+ *   str:    u32 size, the bytes, 0
+ *
+ * The strings are zero-terminated, so the popped lines point right
+ * into the compiled data.
+ */
+
+static const char compiled_magic[8] = {'m', 'y', 'b', 'a', 's', 'h', 'c', '6'};
+
+struct compiled_header {
+	char magic[8];
+	/** Hash of the script text. */
+	uint64_t hash;
+	uint64_t script_size;
+	/** Prefix of the script covered by the records. */
+	uint64_t covered_size;
+};
+
+static uint64_t
+compiled_hash(const char *str, size_t len)
+{
+	const uint64_t mul = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = len * mul;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, str + i, sizeof(word));
+		h = (h ^ word) * mul;
+		h ^= h >> 29;
+	}
+	for (; i < len; ++i) {
+		h = (h ^ (unsigned char)str[i]) * mul;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+template <typename T>
+static void
+compiled_write(std::string *out, T value)
+{
+	out->append((const char *)&value, sizeof(value));
+}
+
+static void
+compiled_write_str(std::string *out, std::string_view str)
+{
+	compiled_write<uint32_t>(out, str.size());
+	out->append(str.data(), str.size());
+	out->push_back(0);
+}
+
+static void
+compiled_write_line(std::string *out, const struct command_line *line)
+{
+	compiled_write<uint8_t>(out, PARSER_ERR_NONE);
+	compiled_write<uint8_t>(out, line->out_type);
+	compiled_write<uint8_t>(out, line->is_background);
+	if (line->out_type != OUTPUT_TYPE_STDOUT)
+		compiled_write_str(out, line->out_file);
+	compiled_write<uint8_t>(out, line->in_type);
+	if (line->in_type != INPUT_TYPE_STDIN)
+		compiled_write_str(out, line->in_source);
+	compiled_write<uint32_t>(out, line->exprs.size());
+	for (const struct expr &e : line->exprs) {
+		compiled_write<uint8_t>(out, e.type);
+		if (e.type != EXPR_TYPE_COMMAND)
+			continue;
+		compiled_write_str(out, e.cmd->exe);
+		compiled_write<uint32_t>(out, e.cmd->args.size());
+		for (std::string_view arg : e.cmd->args)
+			compiled_write_str(out, arg);
+		compiled_write<uint32_t>(out, e.cmd->expansions.size());
+		for (const struct expansion &x : e.cmd->expansions) {
+			compiled_write<uint8_t>(out, x.type);
+			compiled_write<uint32_t>(out, x.word);
+			compiled_write<uint32_t>(out, x.pos);
+			compiled_write<uint8_t>(out, x.is_quoted);
+			compiled_write_str(out, x.text);
+		}
+	}
+}
+
+void
+parser_compile(const char *str, size_t len, std::string *out)
+{
+	out->clear();
+	struct compiled_header header;
+	memcpy(header.magic, compiled_magic, sizeof(header.magic));
+	header.hash = compiled_hash(str, len);
+	header.script_size = len;
+	header.covered_size = 0;
+	out->append((const char *)&header, sizeof(header));
+
+	struct parser *p = parser_new();
+	parser_feed_ref(p, str, len);
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		compiled_write<uint32_t>(out, p->consumed - header.covered_size);
+		if (err != PARSER_ERR_NONE)
+			compiled_write<uint8_t>(out, err);
+		else
+			compiled_write_line(out, line);
+		header.covered_size = p->consumed;
+	}
+	parser_delete(p);
+	memcpy(&(*out)[0], &header, sizeof(header));
+}
+
+/**
+ * Reader of the records. Every read is checked against the end, so
+ * a broken file is found instead of read out of bounds.
+ */
+struct compiled_reader {
+	const char *pos;
+	const char *end;
+	bool is_ok;
+};
+
+template <typename T>
+static T
+compiled_read(struct compiled_reader *r)
+{
+	T res = 0;
+	if ((size_t)(r->end - r->pos) < sizeof(res)) {
+		r->is_ok = false;
+		r->pos = r->end;
+		return res;
+	}
+	memcpy(&res, r->pos, sizeof(res));
+	r->pos += sizeof(res);
+	return res;
+}
+
+static std::string_view
+compiled_read_str(struct compiled_reader *r)
+{
+	uint32_t size = compiled_read<uint32_t>(r);
+	if ((size_t)(r->end - r->pos) <= size || r->pos[size] != 0) {
+		r->is_ok = false;
+		r->pos = r->end;
+		return std::string_view();
+	}
+	std::string_view res(r->pos, size);
+	r->pos += size + 1;
+	return res;
+}
+
+/**
+ * Read one record into the parser. The expansions are checked to fit
+ * their words, the rest is checked by the reader. @a size is how
+ * much of the script text the record covers.
+ */
+static enum parser_error
+compiled_read_record(struct compiled_reader *r, struct parser *p,
+	uint32_t *size)
+{
+	parser_line_reset(p);
+	*size = compiled_read<uint32_t>(r);
+	uint8_t err = compiled_read<uint8_t>(r);
+	if (err > PARSER_ERR_BAD_SUBSTITUTION) {
+		r->is_ok = false;
+		return PARSER_ERR_NONE;
+	}
+	if (err != PARSER_ERR_NONE)
+		return (enum parser_error)err;
+	uint8_t out_type = compiled_read<uint8_t>(r);
+	uint8_t is_background = compiled_read<uint8_t>(r);
+	if (out_type > OUTPUT_TYPE_FILE_APPEND || is_background > 1) {
+		r->is_ok = false;
+		return PARSER_ERR_NONE;
+	}
+	p->line.out_type = (enum output_type)out_type;
+	p->line.is_background = is_background;
+	if (out_type != OUTPUT_TYPE_STDOUT)
+		p->line.out_file = compiled_read_str(r);
+	uint8_t in_type = compiled_read<uint8_t>(r);
+	if (in_type > INPUT_TYPE_TEXT) {
+		r->is_ok = false;
+		return PARSER_ERR_NONE;
+	}
+	p->line.in_type = (enum input_type)in_type;
+	if (in_type != INPUT_TYPE_STDIN)
+		p->line.in_source = compiled_read_str(r);
+	uint32_t expr_count = compiled_read<uint32_t>(r);
+	for (uint32_t i = 0; i < expr_count && r->is_ok; ++i) {
+		uint8_t type = compiled_read<uint8_t>(r);
+		if (type > EXPR_TYPE_OR) {
+			r->is_ok = false;
+			break;
+		}
+		expr e;
+		e.type = (enum expr_type)type;
+		p->exprs.push_back(e);
+		if (e.type != EXPR_TYPE_COMMAND)
+			continue;
+		p->cmds.emplace_back();
+		struct command &cmd = p->cmds.back();
+		cmd.exe = compiled_read_str(r);
+		uint32_t argc = compiled_read<uint32_t>(r);
+		size_t first_arg = p->args.size();
+		for (uint32_t j = 0; j < argc && r->is_ok; ++j) {
+			p->args.push_back(compiled_read_str(r));
+			++cmd.args.count;
+		}
+		uint32_t count = compiled_read<uint32_t>(r);
+		uint64_t prev = 0;
+		for (uint32_t j = 0; j < count && r->is_ok; ++j) {
+			expansion x;
+			uint8_t x_type = compiled_read<uint8_t>(r);
+			x.type = (enum expansion_type)x_type;
+			x.word = compiled_read<uint32_t>(r);
+			x.pos = compiled_read<uint32_t>(r);
+			uint8_t is_quoted = compiled_read<uint8_t>(r);
+			x.text = compiled_read_str(r);
+			x.is_quoted = is_quoted;
+			uint64_t order = ((uint64_t)x.word << 32) | x.pos;
+			if (x_type > EXPANSION_TYPE_VARIABLE ||
+			    x.word > cmd.args.count || is_quoted > 1 || order < prev) {
+				r->is_ok = false;
+				break;
+			}
+			prev = order;
+			std::string_view word = x.word == 0 ? cmd.exe :
+				p->args[first_arg + x.word - 1];
+			if (x.pos > word.size()) {
+				r->is_ok = false;
+				break;
+			}
+			p->expansions.push_back(x);
+			++cmd.expansions.count;
+		}
+	}
+	return PARSER_ERR_NONE;
+}
+
+bool
+parser_feed_compiled(struct parser *p, const char *data, size_t size,
+	const char *str, size_t len)
+{
+	if (p->is_in_line || !p->compiled.empty() ||
+	    p->pos < parser_input(p).size())
+		return false;
+	struct compiled_header header;
+	if (size < sizeof(header))
+		return false;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, compiled_magic, sizeof(header.magic)) != 0 ||
+	    header.script_size != len || header.covered_size > len ||
+	    header.hash != compiled_hash(str, len))
+		return false;
+	struct compiled_reader r;
+	r.pos = data + sizeof(header);
+	r.end = data + size;
+	r.is_ok = true;
+	uint64_t covered_size = 0;
+	while (r.pos < r.end && r.is_ok) {
+		uint32_t record_size;
+		compiled_read_record(&r, p, &record_size);
+		covered_size += record_size;
+	}
+	parser_line_reset(p);
+	if (!r.is_ok || covered_size != header.covered_size)
+		return false;
+	p->compiled = std::string_view(data + sizeof(header),
+		size - sizeof(header));
+	parser_feed_ref(p, str + header.covered_size,
+		len - header.covered_size);
+	return true;
+}
+
+static enum parser_error
+parser_pop_compiled(struct parser *p, struct command_line **out)
+{
+	struct compiled_reader r;
+	r.pos = p->compiled.data();
+	r.end = p->compiled.data() + p->compiled.size();
+	r.is_ok = true;
+	uint32_t size;
+	enum parser_error err = compiled_read_record(&r, p, &size);
+	/* The records were checked when fed. */
+	assert(r.is_ok);
+	p->compiled.remove_prefix(r.pos - p->compiled.data());
+	p->consumed += size;
+	if (err != PARSER_ERR_NONE) {
+		*out = NULL;
+		return err;
+	}
+	parser_line_finish(p);
+	*out = &p->line;
+	return PARSER_ERR_NONE;
+}
@@ -1,11 +1,9 @@
 #pragma once
 
-#include <list>
-#include <optional>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string>
-#include <vector>
+#include <string_view>
 
 struct parser;
 
@@ -20,11 +18,57 @@ enum parser_error {
 	PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG,
 	PARSER_ERR_TOO_LATE_ARGUMENTS,
 	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
+	PARSER_ERR_INPUT_REDIRECT_BAD_ARG,
+	PARSER_ERR_INPUT_REDIRECT_NOT_FIRST,
+	PARSER_ERR_BAD_SUBSTITUTION,
 };
 
+/** Array owned by the parser. */
+template <typename T>
+struct parser_array {
+	T *data = nullptr;
+	uint32_t count = 0;
+
+	bool empty() const { return count == 0; }
+	uint32_t size() const { return count; }
+	T &operator[](uint32_t i) const { return data[i]; }
+	T &front() const { return data[0]; }
+	T &back() const { return data[count - 1]; }
+	T *begin() const { return data; }
+	T *end() const { return data + count; }
+};
+
+enum expansion_type {
+	/** $(...), replaced with the output of the command. */
+	EXPANSION_TYPE_COMMAND,
+	/** $NAME, ${NAME} or $?, replaced with the variable value. */
+	EXPANSION_TYPE_VARIABLE,
+};
+
+/**
+ * Expansion in a word of a command. It is cut out of the word text,
+ * and its value goes to @a pos of the text.
+ */
+struct expansion {
+	enum expansion_type type = EXPANSION_TYPE_COMMAND;
+	/** The exe is the word 0, the args go from 1. */
+	uint32_t word = 0;
+	uint32_t pos = 0;
+	/** The command line inside the parentheses, or the name. */
+	std::string_view text;
+	/** Inside double quotes, so the output isn't split into fields. */
+	bool is_quoted = false;
+};
+
+/**
+ * All the strings of a command line are zero-terminated, so data()
+ * of any of them can be passed where a C string is expected.
+ */
 struct command {
-	std::string exe;
-	std::vector<std::string> args;
+	std::string_view exe;
+	parser_array<std::string_view> args;
+	/** Ordered by the word and the position in it. */
+	parser_array<expansion> expansions;
 };
 
 enum expr_type {
@@ -37,7 +81,7 @@ enum expr_type {
 struct expr {
 	enum expr_type type = EXPR_TYPE_COMMAND;
 	/** Valid if the type is COMMAND. */
-	std::optional<command> cmd;
+	struct command *cmd = nullptr;
 };
 
 enum output_type {
@@ -46,11 +90,26 @@ enum output_type {
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+enum input_type {
+	INPUT_TYPE_STDIN,
+	/** < file */
+	INPUT_TYPE_FILE,
+	/** <<< word or a heredoc, given as the text itself. */
+	INPUT_TYPE_TEXT,
+};
+
 struct command_line {
-	std::list<expr> exprs;
+	parser_array<expr> exprs;
 	enum output_type out_type = OUTPUT_TYPE_STDOUT;
 	/** Non-empty if the out type is FILE. */
-	std::string out_file;
+	std::string_view out_file;
+	/** Input of the first command. */
+	enum input_type in_type = INPUT_TYPE_STDIN;
+	/**
+	 * The file name if the in type is FILE, or the text if it is
+	 * TEXT. Each line of the text ends with a new line.
+	 */
+	std::string_view in_source;
 	bool is_background = false;
 };
 
@@ -60,8 +119,75 @@ parser_new(void);
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
+/**
+ * Feed the data without copying it. The memory is parsed in place
+ * and must stay valid and unchanged until all of it is popped, the
+ * next feed, or deletion of the parser. It is copied only when it
+ * continues a not finished line, and the not finished tail is
+ * copied by the next feed.
+ */
+void
+parser_feed_ref(struct parser *p, const char *str, size_t len);
+
+/**
+ * Get how many bytes of the fed text are parsed since the creation.
+ * Right after a line is popped, it is where the line ends. The
+ * lines of parser_feed_compiled() count as their text.
+ */
+uint64_t
+parser_consumed(const struct parser *p);
+
+/**
+ * Tell the parser that the input is over, after all the lines are
+ * popped. A heredoc which is still open is ended by it, like in bash,
+ * so its line can be popped. Returns the missing end line of such a
+ * heredoc to warn about, valid until the next pop, or NULL if there
+ * was none or it only lacked its line end.
+ */
+const char *
+parser_feed_end(struct parser *p);
+
+/**
+ * Parse the next command line. The line is owned by the parser and
+ * stays valid until the next call of this function or deletion of
+ * the parser. Its memory is reused for the next line, so after
+ * warming up the parsing doesn't allocate anything. A not finished
+ * line is kept in the parser with its tokenizer state, so each fed
+ * byte is parsed once however the input is split.
+ */
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
 void
 parser_delete(struct parser *p);
+
+/**
+ * Parse the whole script and save all its lines and errors into
+ * @a out in a compact binary form, keyed by a hash of the text. It
+ * can be stored and given to parser_feed_compiled() instead of
+ * parsing the script again.
+ */
+void
+parser_compile(const char *str, size_t len, std::string *out);
+
+/**
+ * Feed a script together with its compiled form. The compiled lines
+ * are popped as is, and only the not finished tail of the script is
+ * parsed. Both are used in place and must stay valid until they are
+ * popped or the parser is deleted. Returns false, feeding nothing,
+ * if the data isn't a compiled form of this very script, or the
+ * parser has already been fed.
+ */
+bool
+parser_feed_compiled(struct parser *p, const char *data, size_t size,
+	const char *str, size_t len);
+
+/**
+ * Copy the line into a single heap block, so it stays valid after
+ * the parser moves on. Delete it with command_line_delete().
+ */
+struct command_line *
+command_line_dup(const struct command_line *line);
+
+void
+command_line_delete(struct command_line *line);
@@ -0,0 +1,186 @@
+#include "parser.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <new>
+#include <string>
+
+/*
+ * Throughput benchmark of the parser. A script of the given size
+ * is generated in memory, fed into the parser either at once or
+ * in chunks like the shell reads it, and all the command lines
+ * are popped. One JSON object per line is printed:
+ *
+ *   {"script":"plain","feed":"whole","bytes":...,"lines":...,
+ *    "mb_per_sec":...,"lines_per_sec":...,"allocs_per_line":...}
+ *
+ * "allocs_per_line" counts the heap allocations done by the parser
+ * and the feeding, which should be close to zero once the parser
+ * is warmed up.
+ *
+ * Usage: ./parser_bench [--size MB] [--quick]
+ */
+
+enum {
+	BENCH_CHUNK_SIZE = 4096,
+};
+
+/** Number of operator new calls. */
+static uint64_t bench_alloc_count = 0;
+
+void *
+operator new(size_t size)
+{
+	++bench_alloc_count;
+	void *res = malloc(size == 0 ? 1 : size);
+	if (res == NULL)
+		throw std::bad_alloc();
+	return res;
+}
+
+void
+operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void
+operator delete(void *ptr, size_t size) noexcept
+{
+	(void)size;
+	free(ptr);
+}
+
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Short commands with pipes and redirects, no quoting. */
+static std::string
+bench_script_plain(size_t size)
+{
+	std::string res;
+	res.reserve(size + 128);
+	for (unsigned i = 0; res.size() < size; ++i) {
+		res += "cat file_";
+		res += std::to_string(i % 1000);
+		res += ".txt | grep -v pattern | head -n 10 >> out.txt\n";
+		res += "echo first second third && true || false\n";
+	}
+	return res;
+}
+
+/** Arguments with quotes and escapes, which need copying. */
+static std::string
+bench_script_quoted(size_t size)
+{
+	std::string res;
+	res.reserve(size + 128);
+	while (res.size() < size) {
+		res += "echo \"double quoted text\" 'single quoted text' ";
+		res += "\"with \\\"escapes\\\" inside\" back\\ slash\n";
+		res += "printf '%s\\n' \"a\" 'b' # a comment\n";
+	}
+	return res;
+}
+
+/** One huge command line with lots of arguments. */
+static std::string
+bench_script_long_line(size_t size)
+{
+	std::string res;
+	res.reserve(size + 128);
+	res += "echo";
+	for (unsigned i = 0; res.size() < size; ++i) {
+		res += " arg";
+		res += std::to_string(i);
+	}
+	res += '\n';
+	return res;
+}
+
+static unsigned
+bench_pop_all(struct parser *p)
+{
+	unsigned count = 0;
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			fprintf(stderr, "Unexpected parser error %d\n", (int)err);
+			abort();
+		}
+		if (line == NULL)
+			return count;
+		++count;
+	}
+}
+
+static void
+bench_run_one(const char *name, const std::string &script, bool is_chunked)
+{
+	uint64_t start = bench_now_ns();
+	uint64_t allocs = bench_alloc_count;
+	struct parser *p = parser_new();
+	unsigned lines = 0;
+	const char *pos = script.data();
+	const char *end = pos + script.size();
+	while (pos < end) {
+		size_t len = end - pos;
+		if (is_chunked && len > BENCH_CHUNK_SIZE)
+			len = BENCH_CHUNK_SIZE;
+		parser_feed(p, pos, len);
+		pos += len;
+		lines += bench_pop_all(p);
+	}
+	parser_delete(p);
+	uint64_t duration = bench_now_ns() - start;
+	allocs = bench_alloc_count - allocs;
+	printf("{\"script\":\"%s\",\"feed\":\"%s\",\"bytes\":%zu,"
+		"\"lines\":%u,\"mb_per_sec\":%.1f,\"lines_per_sec\":%.0f,"
+		"\"allocs_per_line\":%.4f}\n",
+		name, is_chunked ? "chunked" : "whole", script.size(), lines,
+		script.size() * 1e3 / duration, lines * 1e9 / duration,
+		(double)allocs / lines);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size_mb = 16;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			size_mb = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--quick") == 0) {
+			size_mb = 2;
+		} else {
+			fprintf(stderr, "Usage: %s [--size MB] [--quick]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	size_t size = size_mb * 1024 * 1024;
+	struct {
+		const char *name;
+		std::string (*generate)(size_t);
+	} scripts[] = {
+		{"plain", bench_script_plain},
+		{"quoted", bench_script_quoted},
+		{"long_line", bench_script_long_line},
+	};
+	for (const auto &s : scripts) {
+		std::string script = s.generate(size);
+		bench_run_one(s.name, script, false);
+		bench_run_one(s.name, script, true);
+	}
+	return 0;
+}
@@ -4,6 +4,8 @@
 
 #include <string.h>
 
+#include <string>
+
 static void
 test_one_word(void)
 {
@@ -22,7 +24,6 @@ test_one_word(void)
 	unit_assert(e->cmd);
 	unit_check(e->cmd->exe == "ls", "exe");
 	unit_check(e->cmd->args.empty(), "arg count");
-	delete line;
 
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
 	unit_check(line == NULL, "no more lines yet");
@@ -36,7 +37,6 @@ test_one_word(void)
 	unit_assert(e->cmd);
 	unit_check(e->cmd->exe == "pwd", "exe");
 	unit_check(e->cmd->args.empty(), "arg count");
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -64,7 +64,6 @@ test_incomplete(void)
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
 	unit_check(line->exprs.front().type == EXPR_TYPE_COMMAND, "expr type");
 	unit_check(line->exprs.front().cmd->exe == "ls", "exe");
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -94,7 +93,6 @@ test_two_words(void)
 	unit_check(e->cmd->exe == "mkdir", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "../testdir", "arg[0]");
-	delete line;
 
 	unit_msg("Quoted argument");
 	str = "touch \"my file with whitespaces in name.txt\"";
@@ -113,7 +111,6 @@ test_two_words(void)
 	unit_check(e->cmd->exe == "touch", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "my file with whitespaces in name.txt", "arg[0]");
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -143,7 +140,6 @@ test_escape_in_string(void)
 	unit_check(e->cmd->exe == "echo", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "123 >&| 456 \\\" str \\\"", "arg[0]");
-	delete line;
 
 	/* echo "test 'test'' \\" */
 	str = "echo \"test 'test'' \\\\\"";
@@ -162,7 +158,6 @@ test_escape_in_string(void)
 	unit_check(e->cmd->exe == "echo", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "test 'test'' \\", "arg[0]");
-	delete line;
 
 	unit_msg("Complex string");
 	/*
@@ -199,7 +194,6 @@ test_escape_in_string(void)
 		"f = open('test.txt', 'a')\\n"
 		"f.write('Text\\\\n')\\n"
 		"f.close()\\n", "arg[0]");
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -232,7 +226,6 @@ test_output_redirect(void)
 	unit_check(e->cmd->exe == "echo", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "123 456 \\\" str \\\"", "arg[0]");
-	delete line;
 
 	unit_msg("Append to file");
 	/* echo "test" >> "my file with whitespaces in name.txt" */
@@ -255,7 +248,6 @@ test_output_redirect(void)
 	unit_check(e->cmd->exe == "echo", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "test", "arg[0]");
-	delete line;
 
 	unit_msg("No spaces");
 	str = "echo \"4\">file";
@@ -277,7 +269,6 @@ test_output_redirect(void)
 	unit_check(e->cmd->exe == "echo", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "4", "arg[0]");
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -309,7 +300,6 @@ test_escape_outside_of_string(void)
 	unit_check(e->cmd->exe == "cat", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "my file with whitespaces in name.txt", "arg[0]");
-	delete line;
 
 	unit_msg("Escape new line");
 	/*
@@ -334,7 +324,6 @@ test_escape_outside_of_string(void)
 	unit_check(e->cmd->exe == "echo", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "123456", "arg[0]");
-	delete line;
 
 	/*
 	 * echo 123\
@@ -372,7 +361,6 @@ test_escape_outside_of_string(void)
 	unit_check(e->cmd->args[0] == "2", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -416,7 +404,6 @@ test_pipe(void)
 	unit_check(e->cmd->args[0] == "100", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	unit_msg("Multiple pipes");
 	str = "echo 'source string' | sed 's/source/destination/g' | sed 's/string/value/g'";
@@ -461,7 +448,6 @@ test_pipe(void)
 	unit_check(e->cmd->args[0] == "s/string/value/g", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	unit_msg("Multiple args and pipes");
 	str = "yes bigdata | head -n 100000 | wc -l | tr -d [:blank:]";
@@ -519,7 +505,6 @@ test_pipe(void)
 	unit_check(e->cmd->args[1] == "[:blank:]", "arg[1]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -550,7 +535,6 @@ test_comments(void)
 	unit_check(e->cmd->exe == "echo", "exe");
 	unit_check(e->cmd->args.size() == 1, "arg count");
 	unit_check(e->cmd->args[0] == "100", "arg[0]");
-	delete line;
 
 	str = " # empty line, only comment";
 	len = strlen(str);
@@ -582,7 +566,6 @@ test_comments(void)
 	unit_check(e->cmd->args.size() == 2, "arg count");
 	unit_check(e->cmd->args[0] == "300", "arg[0]");
 	unit_check(e->cmd->args[1] == "400", "arg[1]");
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -632,7 +615,6 @@ test_multiline_string(void)
 	unit_check(e->cmd->args[0] == "4", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -675,7 +657,6 @@ test_logical_operators(void)
 	unit_check(e->cmd->args[0] == "123", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	unit_msg("Multiple operators");
 	str = "true || false || true && echo 123";
@@ -727,7 +708,6 @@ test_logical_operators(void)
 	unit_check(e->cmd->args[0] == "123", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	unit_msg("Logical operators and pipes");
 	str = "echo 100 | grep 1 && echo 200 | grep 2";
@@ -782,7 +762,6 @@ test_logical_operators(void)
 	unit_check(e->cmd->args[0] == "2", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -827,7 +806,6 @@ test_background(void)
 	unit_check(e->cmd->args[0] == "back sleep is done", "arg[0]");
 
 	unit_assert(++e == line->exprs.end());
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
@@ -868,6 +846,27 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "exe < &&", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "exe <<< $(a)", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "a | b < f", PARSER_ERR_INPUT_REDIRECT_NOT_FIRST);
+	test_error_one(p, "exe < a <<< b", PARSER_ERR_INPUT_REDIRECT_NOT_FIRST);
+	test_error_one(p, "< test.txt", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "echo ${}", PARSER_ERR_BAD_SUBSTITUTION);
+	test_error_one(p, "echo ${A:-x}", PARSER_ERR_BAD_SUBSTITUTION);
+	test_error_one(p, "echo ${$}", PARSER_ERR_BAD_SUBSTITUTION);
+	test_error_one(p, "echo ${?A}", PARSER_ERR_BAD_SUBSTITUTION);
+	test_error_one(p, "echo \"${A B}\"", PARSER_ERR_BAD_SUBSTITUTION);
+	test_error_one(p, "echo ${A", PARSER_ERR_BAD_SUBSTITUTION);
+
+	unit_msg("an unterminated ${ doesn't take the next lines");
+	const char *str = "echo ${A 'x'\necho ok\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_BAD_SUBSTITUTION,
+		"parse error");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		line != NULL && line->exprs[0].cmd->exe == "echo" &&
+		line->exprs[0].cmd->args.size() == 1 &&
+		line->exprs[0].cmd->args[0] == "ok", "next line");
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -876,12 +875,485 @@ test_errors(void)
 	unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
 	unit_assert(e->cmd);
 	unit_check(e->cmd->exe == "echo", "exe");
-	delete line;
 
 	parser_delete(p);
 	unit_test_finish();
 }
 
+static void
+test_line_dup(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	const char *str = "echo 'a b' c | grep -v x && true >> \"out file\" &\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	struct command_line *copy = command_line_dup(line);
+
+	unit_msg("The copy survives the next line");
+	str = "ls -l\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->exprs.front().cmd->exe == "ls", "next line");
+	parser_delete(p);
+
+	unit_check(copy->exprs.size() == 5, "expr count");
+	unit_check(copy->out_type == OUTPUT_TYPE_FILE_APPEND, "out type");
+	unit_check(copy->out_file == "out file", "out file");
+	unit_check(copy->out_file.data()[copy->out_file.size()] == 0,
+		"out file is zero-terminated");
+	unit_check(copy->is_background, "is background");
+	struct expr *e = &copy->exprs[0];
+	unit_check(e->type == EXPR_TYPE_COMMAND, "expr type");
+	unit_check(e->cmd->exe == "echo", "exe");
+	unit_check(e->cmd->args.size() == 2, "arg count");
+	unit_check(e->cmd->args[0] == "a b", "arg[0]");
+	unit_check(e->cmd->args[1] == "c", "arg[1]");
+	unit_check(copy->exprs[1].type == EXPR_TYPE_PIPE, "pipe");
+	e = &copy->exprs[2];
+	unit_check(e->cmd->exe == "grep", "exe");
+	unit_check(e->cmd->args.size() == 2, "arg count");
+	unit_check(e->cmd->args[1] == "x", "arg[1]");
+	unit_check(copy->exprs[3].type == EXPR_TYPE_AND, "and");
+	e = &copy->exprs[4];
+	unit_check(e->cmd->exe == "true", "exe");
+	unit_check(e->cmd->args.empty(), "no args");
+	command_line_delete(copy);
+	unit_test_finish();
+}
+
+static void
+test_feed_ref(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	std::string str = "echo a\necho 'b\nc";
+	parser_feed_ref(p, str.data(), str.size());
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->exprs[0].cmd->args[0] == "a", "in place line");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		line == NULL, "not finished line");
+
+	unit_msg("The tail is copied by the next feed");
+	parser_feed(p, "' d\n", 4);
+	str.assign(str.size(), 'x');
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->exprs[0].cmd->args[0] == "b\nc", "arg[0]");
+	unit_check(line->exprs[0].cmd->args[1] == "d", "arg[1]");
+
+	unit_msg("A continuation is copied");
+	parser_feed(p, "echo ", 5);
+	str = "e\n";
+	parser_feed_ref(p, str.data(), str.size());
+	str.assign(str.size(), 'x');
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->exprs[0].cmd->args[0] == "e", "arg[0]");
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_long_quoted_bytewise(void)
+{
+	unit_test_start();
+	/*
+	 * The not finished token is kept between the feeds. If it was
+	 * parsed again on each of them, this would never end.
+	 */
+	const size_t size = 10 * 1024 * 1024;
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	parser_feed(p, "echo \"", 6);
+	bool is_ok = true;
+	for (size_t i = 0; i < size && is_ok; ++i) {
+		parser_feed(p, i % 64 == 63 ? "\n" : "a", 1);
+		is_ok = parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+			line == NULL;
+	}
+	unit_check(is_ok, "no line until the quote is closed");
+	parser_feed(p, "\"\n", 2);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	std::string_view arg = line->exprs[0].cmd->args[0];
+	unit_check(arg.size() == size, "arg size");
+	unit_check(arg[0] == 'a' && arg[63] == '\n', "arg text");
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_compiled(void)
+{
+	unit_test_start();
+	const char *script = "echo 'a b' | grep a > \"out file\" &\n"
+		"# comment\n"
+		"exe && |\n"
+		"true || false\n"
+		"echo \"not fin";
+	size_t len = strlen(script);
+	std::string data;
+	parser_compile(script, len, &data);
+
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	unit_check(parser_feed_compiled(p, data.data(), data.size(), script,
+		len), "feed");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->exprs.size() == 3, "expr count");
+	unit_check(line->exprs[0].cmd->exe == "echo", "exe");
+	unit_check(line->exprs[0].cmd->args[0] == "a b", "arg");
+	unit_check(line->exprs[1].type == EXPR_TYPE_PIPE, "pipe");
+	unit_check(line->exprs[2].cmd->args[0] == "a", "arg");
+	unit_check(line->out_type == OUTPUT_TYPE_FILE_NEW, "out type");
+	unit_check(line->out_file == "out file", "out file");
+	unit_check(line->is_background, "is background");
+	size_t first_len = strchr(script, '\n') + 1 - script;
+	unit_check(parser_consumed(p) == first_len, "consumed the line");
+	unit_check(parser_pop_next(p, &line) ==
+		PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND, "error");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->exprs.size() == 3, "expr count");
+	unit_check(line->exprs[1].type == EXPR_TYPE_OR, "or");
+	size_t tail_len = strlen("echo \"not fin");
+	unit_check(parser_consumed(p) == len - tail_len, "consumed the lines");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		line == NULL, "the tail is not finished");
+
+	unit_msg("The tail is parsed as text");
+	parser_feed(p, "ished\"\n", 7);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	unit_check(line->exprs[0].cmd->args[0] == "not finished", "arg");
+	unit_check(parser_consumed(p) == len + 7, "consumed the tail");
+	parser_delete(p);
+
+	unit_msg("The same without the compiled form");
+	p = parser_new();
+	parser_feed(p, script, len);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		line != NULL, "parse");
+	unit_check(parser_consumed(p) == first_len, "consumed the line");
+	parser_delete(p);
+
+	unit_msg("The last error is stored too");
+	const char *bad = "echo ${}\n";
+	std::string bad_data;
+	parser_compile(bad, strlen(bad), &bad_data);
+	p = parser_new();
+	unit_check(parser_feed_compiled(p, bad_data.data(), bad_data.size(),
+		bad, strlen(bad)), "feed");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_BAD_SUBSTITUTION,
+		"error");
+	parser_delete(p);
+
+	unit_msg("Another script or broken data are not accepted");
+	p = parser_new();
+	std::string other = script;
+	other[1] = 'E';
+	unit_check(!parser_feed_compiled(p, data.data(), data.size(),
+		other.data(), other.size()), "other script");
+	unit_check(!parser_feed_compiled(p, data.data(), data.size() - 3,
+		script, len), "truncated");
+	data[data.size() - 1] = 1;
+	unit_check(!parser_feed_compiled(p, data.data(), data.size(),
+		script, len), "broken");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		line == NULL, "nothing is fed");
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_expansion_check(const struct command_line *line)
+{
+	unit_assert(line != NULL);
+	unit_assert(line->exprs.size() == 1);
+	const struct command *cmd = line->exprs[0].cmd;
+	unit_check(cmd->exe == "echo", "exe");
+	unit_assert(cmd->args.size() == 5);
+	unit_check(cmd->args[0] == "ab", "arg[0]");
+	unit_check(cmd->args[1] == "x  y", "arg[1]");
+	unit_check(cmd->args[2] == "", "arg[2]");
+	unit_check(cmd->args[3] == "$(no)", "arg[3]");
+	unit_check(cmd->args[4] == "$(no) $", "arg[4]");
+	unit_assert(cmd->expansions.size() == 3);
+	const struct expansion *x = &cmd->expansions[0];
+	unit_check(x->word == 1 && x->pos == 1 && !x->is_quoted, "expansion 0");
+	unit_check(x->text == "ls -l | wc", "expansion 0 text");
+	x = &cmd->expansions[1];
+	unit_check(x->word == 2 && x->pos == 2 && x->is_quoted, "expansion 1");
+	unit_check(x->text == "date '+)'", "expansion 1 text");
+	x = &cmd->expansions[2];
+	unit_check(x->word == 3 && x->pos == 0 && !x->is_quoted, "expansion 2");
+	unit_check(x->text == "echo $(echo \"(\")", "expansion 2 text");
+}
+
+static void
+test_expansion(void)
+{
+	unit_test_start();
+	const char *str = "echo a$(ls -l | wc)b \"x $(date '+)') y\" "
+		"$(echo $(echo \"(\")) \\$(no) \"\\$(no) $\"\n";
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	test_expansion_check(line);
+	struct command_line *copy = command_line_dup(line);
+
+	unit_msg("Fed byte by byte");
+	for (const char *c = str; *c != 0; ++c) {
+		parser_feed(p, c, 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+	}
+	test_expansion_check(line);
+
+	unit_msg("Copied");
+	test_expansion_check(copy);
+	command_line_delete(copy);
+
+	unit_msg("Compiled");
+	std::string data;
+	parser_compile(str, strlen(str), &data);
+	parser_delete(p);
+	p = parser_new();
+	unit_check(parser_feed_compiled(p, data.data(), data.size(), str,
+		strlen(str)), "feed");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	test_expansion_check(line);
+
+	unit_msg("Not in the output file");
+	str = "echo > $(echo f)\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) ==
+		PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG, "error");
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_variable_check(const struct command_line *line)
+{
+	unit_assert(line != NULL);
+	unit_assert(line->exprs.size() == 1);
+	const struct command *cmd = line->exprs[0].cmd;
+	unit_check(cmd->exe == "echo", "exe");
+	unit_assert(cmd->args.size() == 6);
+	unit_check(cmd->args[0] == "", "arg[0]");
+	unit_check(cmd->args[1] == "xy", "arg[1]");
+	unit_check(cmd->args[2] == " z", "arg[2]");
+	unit_check(cmd->args[3] == "-", "arg[3]");
+	unit_check(cmd->args[4] == "$1", "arg[4]");
+	unit_check(cmd->args[5] == "$D", "arg[5]");
+	unit_assert(cmd->expansions.size() == 5);
+	const struct {
+		uint32_t word;
+		uint32_t pos;
+		const char *name;
+		bool is_quoted;
+	} expected[] = {
+		{1, 0, "A", false},
+		{2, 1, "B", false},
+		{3, 0, "C_1", true},
+		{4, 0, "?", false},
+		{4, 1, "?", false},
+	};
+	for (uint32_t i = 0; i < cmd->expansions.size(); ++i) {
+		const struct expansion *x = &cmd->expansions[i];
+		unit_check(x->type == EXPANSION_TYPE_VARIABLE &&
+			x->word == expected[i].word && x->pos == expected[i].pos &&
+			x->text == expected[i].name &&
+			x->is_quoted == expected[i].is_quoted, "expansion");
+	}
+}
+
+static void
+test_variable(void)
+{
+	unit_test_start();
+	const char *str = "echo $A x${B}y \"${C_1} z\" $?-${?} $1 '$D'\n";
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	test_variable_check(line);
+
+	unit_msg("Fed byte by byte");
+	for (const char *c = str; *c != 0; ++c) {
+		parser_feed(p, c, 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+	}
+	test_variable_check(line);
+
+	unit_msg("Split at each byte");
+	uint32_t len = strlen(str);
+	for (uint32_t i = 1; i < len; ++i) {
+		parser_feed(p, str, i);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+		parser_feed(p, str + i, len - i);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		test_variable_check(line);
+	}
+
+	unit_msg("Compiled");
+	std::string data;
+	parser_compile(str, strlen(str), &data);
+	parser_delete(p);
+	p = parser_new();
+	unit_check(parser_feed_compiled(p, data.data(), data.size(), str,
+		strlen(str)), "feed");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	test_variable_check(line);
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static const char *input_redirect_script =
+	"wc -l < in.txt | cat\n"
+	"<in.txt cat > out.txt\n"
+	"cat <<< 'a b'\n"
+	"cat <<END | wc -c\n"
+	"line 1\n"
+	"  $X \"q\" <<END\n"
+	"END\n"
+	"a | b < f <<E\n"
+	"skipped\n"
+	"E\n"
+	"echo done\n";
+
+/** Pop all the lines, checking them one by one. */
+static void
+test_input_redirect_check(struct parser *p, int *count)
+{
+	struct command_line *line = NULL;
+	while (true) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			return;
+		int i = (*count)++;
+		if (i == 4) {
+			unit_fail_if(err != PARSER_ERR_INPUT_REDIRECT_NOT_FIRST);
+			continue;
+		}
+		unit_fail_if(err != PARSER_ERR_NONE);
+		unit_assert(line != NULL);
+		const struct command *cmd = line->exprs[0].cmd;
+		switch (i) {
+		case 0:
+			unit_fail_if(line->exprs.size() != 3);
+			unit_fail_if(cmd->exe != "wc" || cmd->args.size() != 1);
+			unit_fail_if(line->in_type != INPUT_TYPE_FILE);
+			unit_fail_if(line->in_source != "in.txt");
+			break;
+		case 1:
+			unit_fail_if(cmd->exe != "cat" || cmd->args.size() != 0);
+			unit_fail_if(line->in_type != INPUT_TYPE_FILE);
+			unit_fail_if(line->in_source != "in.txt");
+			unit_fail_if(line->out_type != OUTPUT_TYPE_FILE_NEW);
+			unit_fail_if(line->out_file != "out.txt");
+			break;
+		case 2:
+			unit_fail_if(cmd->exe != "cat" || cmd->args.size() != 0);
+			unit_fail_if(line->in_type != INPUT_TYPE_TEXT);
+			unit_fail_if(line->in_source != "a b\n");
+			break;
+		case 3:
+			unit_fail_if(line->exprs.size() != 3);
+			unit_fail_if(cmd->exe != "cat" || cmd->args.size() != 0);
+			unit_fail_if(line->in_type != INPUT_TYPE_TEXT);
+			unit_fail_if(line->in_source !=
+				"line 1\n  $X \"q\" <<END\n");
+			break;
+		case 5:
+			unit_fail_if(cmd->exe != "echo");
+			unit_fail_if(line->in_type != INPUT_TYPE_STDIN);
+			unit_fail_if(!line->in_source.empty());
+			break;
+		default:
+			unit_fail_if(true);
+		}
+	}
+}
+
+static void
+test_input_redirect(void)
+{
+	unit_test_start();
+	const char *str = input_redirect_script;
+	uint32_t len = strlen(str);
+	struct parser *p = parser_new();
+	int count = 0;
+	parser_feed(p, str, len);
+	test_input_redirect_check(p, &count);
+	unit_check(count == 6, "parse");
+
+	count = 0;
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, str + i, 1);
+		test_input_redirect_check(p, &count);
+	}
+	unit_check(count == 6, "fed byte by byte");
+
+	bool is_ok = true;
+	for (uint32_t i = 1; i < len && is_ok; ++i) {
+		count = 0;
+		parser_feed(p, str, i);
+		test_input_redirect_check(p, &count);
+		parser_feed(p, str + i, len - i);
+		test_input_redirect_check(p, &count);
+		is_ok = count == 6;
+	}
+	unit_check(is_ok, "split at each byte");
+
+	std::string data;
+	parser_compile(str, len, &data);
+	parser_delete(p);
+	p = parser_new();
+	unit_check(parser_feed_compiled(p, data.data(), data.size(), str, len),
+		"feed compiled");
+	count = 0;
+	test_input_redirect_check(p, &count);
+	unit_check(count == 6, "compiled");
+
+	struct command_line *line = NULL;
+	parser_feed(p, "cat <<E\nx\nE", 11);
+	unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+	unit_fail_if(line != NULL);
+	unit_check(parser_feed_end(p) == NULL, "end line at the input end");
+	unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+	unit_check(line != NULL && line->in_source == "x\n",
+		"heredoc ended at the input end");
+	parser_feed(p, "cat <<E\nx", 9);
+	unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+	unit_fail_if(line != NULL);
+	const char *end = parser_feed_end(p);
+	unit_check(end != NULL && strcmp(end, "E") == 0,
+		"no end line at the input end");
+	unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+	unit_check(line != NULL && line->in_source == "x\n",
+		"heredoc ended by the input end");
+	unit_check(parser_feed_end(p) == NULL, "no heredoc");
+
+	parser_feed(p, "cat <<E\nx\nE\n", 12);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line != NULL);
+	struct command_line *copy = command_line_dup(line);
+	parser_delete(p);
+	unit_check(copy->in_type == INPUT_TYPE_TEXT &&
+		copy->in_source == "x\n", "dup");
+	command_line_delete(copy);
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -897,5 +1369,12 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_line_dup();
+	test_feed_ref();
+	test_long_quoted_bytewise();
+	test_compiled();
+	test_expansion();
+	test_variable();
+	test_input_redirect();
 	return 0;
 }
@@ -1,27 +1,83 @@
 #include "parser.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+
+struct shell_options {
+    /** Capacity of the pipes between the stages, 0 for the default. */
+    int pipe_size = 0;
+    /** Max number of running background jobs, 0 for no limit. */
+    int max_jobs = 0;
+    /** Collect the resource usage and report it at exit. */
+    bool is_profiling = false;
+    /** Keep the compiled form of a script next to it. */
+    bool is_caching_scripts = false;
+    /** Run all the scripts of the directory instead of stdin. */
+    const char* batch_dir = nullptr;
+    /** Max number of the batch scripts running at once. */
+    int batch_jobs = 0;
+};
+
+static shell_options options;
+
 struct exec_result {
     int code = 0;
     bool should_exit = false;
 };
 
+struct pipeline_stage {
+    /** -1 stands for a builtin or a stage which failed to start. */
+    pid_t pid = -1;
+    /** A builtin writing into a pipe runs on a helper thread. */
+    std::thread thread;
+    /** Exit code of a builtin or of a stage which failed to start. */
+    int code = 1;
+    /** Filled when profiling. A builtin has the usage of its thread. */
+    struct rusage usage = {};
+    uint64_t end_ns = 0;
+};
+
 struct pipeline_state {
-    std::vector<pid_t> process_ids;
+    /**
+     * Helper threads store the builtin codes right into the stages,
+     * so the vector is reserved beforehand and never reallocated.
+     */
+    std::vector<pipeline_stage> stages;
     int current_input = STDIN_FILENO;
 };
 
@@ -30,18 +86,379 @@ struct parsed_sequence {
     std::vector<expr_type> operators;
 };
 
+struct builtin_ctx {
+    /** Input of the builtin, STDIN_FILENO if it is not piped into. */
+    int in_fd;
+    /** Where the builtin output goes. */
+    int out_fd;
+    /** Status of the previous pipeline, for `exit` without args. */
+    int last_status;
+    /**
+     * The builtin is a part of a pipeline. It runs as if it was in a
+     * subshell then, and must not change the shell state.
+     */
+    bool is_piped;
+    /** Environment of the command, with its own assignments. */
+    char* const* envp;
+};
+
+struct builtin_desc {
+    const char* name;
+    /**
+     * Whether the builtin can handle the arguments exactly like the
+     * external program does. Nullptr means it always can.
+     */
+    bool (*is_applicable)(const command& cmd);
+    int (*run)(const command& cmd, const builtin_ctx& ctx);
+};
+
+struct path_cache_entry {
+    std::string path;
+    /** How many times the command was launched, for `hash`. */
+    unsigned hits = 0;
+};
+
+/**
+ * Resolved paths of the commands, like the bash `hash` table, so a
+ * launch doesn't probe every PATH entry each time. It is dropped when
+ * PATH changes. `hash` can run on a helper thread, hence the mutex.
+ */
+struct path_cache {
+    std::mutex mutex;
+    /** PATH the entries were resolved with. */
+    std::string path_env;
+    std::unordered_map<std::string, path_cache_entry> entries;
+};
+
+static path_cache command_paths;
+
+struct shell_variable {
+    std::string value;
+    bool is_exported = false;
+};
+
+/**
+ * Variables of the shell. The environment of the launched programs
+ * is built of the exported ones and cached until one of them changes,
+ * so a launch passes it as is instead of walking the table. Only the
+ * main thread changes the table, and never while a pipeline runs.
+ */
+struct variable_table {
+    std::unordered_map<std::string, shell_variable> vars;
+    /** NAME=value of the exported variables. */
+    std::vector<std::string> env;
+    /** Pointers to @a env and nullptr, the envp of posix_spawn(). */
+    std::vector<char*> envp;
+    bool is_env_valid = false;
+};
+
+static variable_table shell_vars;
+
+enum {
+    /** Files appended to which are kept open for the next commands. */
+    OUTPUT_CACHE_SIZE = 8,
+};
+
+struct output_cache_entry {
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    /** The last use, the least recent one is evicted. */
+    uint64_t used_at;
+};
+
+/**
+ * Files opened by >>, so a script appending to a log on each command
+ * doesn't open and close it each time. O_APPEND makes each write go
+ * to the end, however many others write there.
+ */
+struct output_cache {
+    std::vector<output_cache_entry> entries;
+    uint64_t clock = 0;
+};
+
+static output_cache output_files;
+
+struct profile_entry {
+    unsigned calls = 0;
+    uint64_t wall_ns = 0;
+    uint64_t user_us = 0;
+    uint64_t sys_us = 0;
+    long max_rss_kb = 0;
+    uint64_t voluntary_switches = 0;
+    uint64_t involuntary_switches = 0;
+};
+
+/**
+ * Resource usage of the foreground pipelines and of their stages,
+ * keyed by their text. Collected with --profile, reported at exit.
+ * Background jobs run in forked shells and are not counted.
+ */
+struct profile {
+    std::unordered_map<std::string, profile_entry> pipelines;
+    std::unordered_map<std::string, profile_entry> stages;
+};
+
+static profile shell_profile;
+
+struct job_process {
+    pid_t pid;
+    /** -1 if pidfds are not supported, the job is polled then. */
+    int pidfd;
+};
+
+struct job {
+    /** Number for `jobs` and `wait %N`. */
+    int id;
+    /** The last stage of the pipeline, or the shell forked to run the line. */
+    pid_t pid;
+    /** Running processes of the job. */
+    std::vector<job_process> procs;
+    /** Some of the processes have no pidfd. */
+    bool is_polled;
+    /* Neither done nor queued means running. */
+    bool is_done;
+    /** `jobs` has shown the job as done, `wait` can still get it. */
+    bool is_reported;
+    /** Exit code, valid when the job is done. */
+    int code;
+    /** The command line, for `jobs`. */
+    std::string text;
+    /** Copy of the line while the job waits in the queue. */
+    command_line* line;
+    /** Status to start the job with, for `exit` without args. */
+    int last_status;
+};
+
+enum {
+    /** Done jobs remembered until `wait` takes their codes. */
+    JOB_DONE_MAX = 1024,
+    JOB_REAP_BATCH = 64,
+    /**
+     * Default job limit per CPU. Jobs are often blocked on I/O with
+     * the foreground, and with one job per CPU the queued writer the
+     * foreground reads from would never start.
+     */
+    JOB_DEFAULT_MAX_PER_CPU = 16,
+};
+
+enum {
+    /** First size of a stdin read. Doubles while the reads fill it. */
+    READ_SIZE_MIN = 64 * 1024,
+    READ_SIZE_MAX = 4 * 1024 * 1024,
+};
+
+enum {
+    /** Buffer of the tee builtin when it has to copy. */
+    TEE_BUFFER_SIZE = 64 * 1024,
+    /** Max bytes moved by one tee() or splice(). */
+    TEE_CHUNK_SIZE = 1024 * 1024,
+};
+
+/**
+ * Background jobs. At most max_jobs of them run at once, the rest
+ * wait in the queue. A single pipeline of programs is started right
+ * from the shell, and its stages are the processes of the job. Other
+ * lines run in a forked shell. Each running process has a pidfd in an
+ * epoll set, so a reap costs one epoll_wait() plus a waitpid() per
+ * exited process instead of a waitpid() per job. Done jobs keep their
+ * codes for `wait`, up to JOB_DONE_MAX of them. The main thread
+ * changes the table only between the pipelines, so a piped `jobs`
+ * reads it without locking.
+ */
+struct job_table {
+    int epoll_fd = -1;
+    std::map<int, job> jobs;
+    /**
+     * Ids of the queued jobs, the oldest starts first. Not a deque,
+     * which allocates already when a static one is constructed.
+     */
+    std::set<int> queue;
+    int next_id = 1;
+    /** Running jobs with pidfds of all their processes in the epoll set. */
+    int watched_count = 0;
+    /** Running jobs polled with waitpid(). */
+    int polled_count = 0;
+    int done_count = 0;
+};
+
+static job_table shell_jobs;
+
+static bool
+run_command_sequence(const command_line* line, int& last_status, bool allow_exit);
+
+/** The script file of stdin which the parser is fed with. */
+struct stdin_script {
+    /** Offset in the file where the fed text starts. */
+    off_t offset;
+    /** A command moved stdin, so the rest is parsed from there. */
+    bool is_moved;
+};
+
+/**
+ * Where stdin has to be for the processes of the running line, or -1
+ * if it isn't a line of the stdin script. It is moved there only when
+ * the first such process starts, so the lines of builtins cost no
+ * syscalls.
+ */
+static off_t stdin_line_end = -1;
+static bool is_stdin_at_line_end = false;
+
+/** Move stdin to the running line end before a process inherits it. */
+static void
+stdin_sync()
+{
+    if (stdin_line_end >= 0 && !is_stdin_at_line_end) {
+        lseek(STDIN_FILENO, stdin_line_end, SEEK_SET);
+        is_stdin_at_line_end = true;
+    }
+}
+
+static bool
+execute_parsed_lines(struct parser* p, int& last_status, stdin_script* script);
+
+static bool
+start_background_pipeline(const command_line& line, int last_status, std::vector<pid_t>& pids,
+                          pid_t& last_pid, int& code);
+
+static bool
+is_variable_name(std::string_view name)
+{
+    if (name.empty() || isdigit((unsigned char)name[0])) {
+        return false;
+    }
+    for (char c : name) {
+        if (!isalnum((unsigned char)c) && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+variable_table_init()
+{
+    for (char** env = environ; *env != nullptr; ++env) {
+        std::string_view str(*env);
+        size_t eq = str.find('=');
+        if (eq == std::string_view::npos) {
+            continue;
+        }
+        shell_variable& var = shell_vars.vars[std::string(str.substr(0, eq))];
+        var.value = str.substr(eq + 1);
+        var.is_exported = true;
+    }
+}
+
+static void
+variable_table_free()
+{
+    std::unordered_map<std::string, shell_variable>().swap(shell_vars.vars);
+    std::vector<std::string>().swap(shell_vars.env);
+    std::vector<char*>().swap(shell_vars.envp);
+}
+
+/** Value of the variable, nullptr if it is not set. */
+static const std::string*
+variable_find(std::string_view name)
+{
+    auto it = shell_vars.vars.find(std::string(name));
+    return it != shell_vars.vars.end() ? &it->second.value : nullptr;
+}
+
+static void
+variable_set(std::string_view name, std::string_view value, bool is_exported)
+{
+    shell_variable& var = shell_vars.vars[std::string(name)];
+    var.value = value;
+    var.is_exported = var.is_exported || is_exported;
+    if (var.is_exported) {
+        shell_vars.is_env_valid = false;
+    }
+}
+
+/** Export the variable, setting it empty if it is not set yet. */
+static void
+variable_export(std::string_view name)
+{
+    shell_variable& var = shell_vars.vars[std::string(name)];
+    if (!var.is_exported) {
+        var.is_exported = true;
+        shell_vars.is_env_valid = false;
+    }
+}
+
+static void
+variable_unset(std::string_view name)
+{
+    auto it = shell_vars.vars.find(std::string(name));
+    if (it == shell_vars.vars.end()) {
+        return;
+    }
+    if (it->second.is_exported) {
+        shell_vars.is_env_valid = false;
+    }
+    shell_vars.vars.erase(it);
+}
+
+/**
+ * Environment of the launched programs. It is rebuilt only when an
+ * exported variable has changed since the last call.
+ */
+static char**
+variable_table_envp()
+{
+    variable_table& table = shell_vars;
+    if (table.is_env_valid) {
+        return table.envp.data();
+    }
+    table.env.clear();
+    for (const auto& [name, var] : table.vars) {
+        if (!var.is_exported) {
+            continue;
+        }
+        std::string& str = table.env.emplace_back(name);
+        str += '=';
+        str += var.value;
+    }
+    table.envp.clear();
+    for (std::string& str : table.env) {
+        table.envp.push_back(str.data());
+    }
+    table.envp.push_back(nullptr);
+    table.is_env_valid = true;
+    return table.envp.data();
+}
+
 static std::string
 get_cd_path(const command& cmd)
 {
     if (cmd.args.empty()) {
-        const char* home = getenv("HOME");
-        return home ? std::string(home) : std::string();
+        const std::string* home = variable_find("HOME");
+        return home ? *home : std::string();
+    }
+    return std::string(cmd.args[0]);
+}
+
+
+/** Check that chdir() to the path would succeed, without doing it. */
+static int
+check_directory(const std::string& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
     }
-    return cmd.args[0];
+    return access(path.c_str(), X_OK);
 }
 
 static int
-change_directory(const command& cmd)
+change_directory(const command& cmd, bool is_piped)
 {
     std::string path = get_cd_path(cmd);
 
@@ -50,7 +467,8 @@ change_directory(const command& cmd)
         return 1;
     }
 
-    if (chdir(path.c_str()) != 0) {
+    int rc = is_piped ? check_directory(path) : chdir(path.c_str());
+    if (rc != 0) {
         fprintf(stderr, "cd: %s: %s\n", path.c_str(), strerror(errno));
         return 1;
     }
@@ -88,9 +506,9 @@ get_exit_code(const command& cmd, int last_status)
         return last_status;
     }
 
-    int code = parse_exit_code(cmd.args[0]);
+    int code = parse_exit_code(std::string(cmd.args[0]));
     if (code == -1) {
-        fprintf(stderr, "exit: invalid exit code: %s\n", cmd.args[0].c_str());
+        fprintf(stderr, "exit: invalid exit code: %s\n", cmd.args[0].data());
         return 1;
     }
 
@@ -102,176 +520,1978 @@ make_argv(const command& cmd)
 {
     std::vector<char*> argv;
     argv.reserve(cmd.args.size() + 2);
-    argv.push_back(const_cast<char*>(cmd.exe.c_str()));
+    argv.push_back(const_cast<char*>(cmd.exe.data()));
     for (const auto& arg : cmd.args) {
-        argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(const_cast<char*>(arg.data()));
     }
     argv.push_back(nullptr);
     return argv;
 }
 
-static void
-close_pipe_descriptors(int pipefd[2], int current_input)
+static void
+output_cache_evict(size_t i)
+{
+    std::vector<output_cache_entry>& entries = output_files.entries;
+    close(entries[i].fd);
+    entries[i] = std::move(entries.back());
+    entries.pop_back();
+}
+
+/** Close the cached files but @a fd. Returns whether any was closed. */
+static bool
+output_cache_drop_except(int fd)
+{
+    bool is_dropped = false;
+    for (size_t i = 0; i < output_files.entries.size();) {
+        if (output_files.entries[i].fd == fd) {
+            ++i;
+            continue;
+        }
+        output_cache_evict(i);
+        is_dropped = true;
+    }
+    return is_dropped;
+}
+
+static void
+output_cache_free()
+{
+    while (!output_files.entries.empty()) {
+        output_cache_evict(0);
+    }
+    std::vector<output_cache_entry>().swap(output_files.entries);
+}
+
+/**
+ * Open the file for appending or take it from the cache. A cached fd
+ * is used while the path leads to the same file, a stat() instead of
+ * an open() and a close(). A moved or deleted file, or a relative
+ * path after cd, gets a new fd.
+ */
+static int
+output_cache_open(const char* path)
+{
+    output_cache& cache = output_files;
+    ++cache.clock;
+    struct stat st;
+    bool is_found = stat(path, &st) == 0;
+    for (size_t i = 0; i < cache.entries.size(); ++i) {
+        output_cache_entry& entry = cache.entries[i];
+        if (entry.path != path) {
+            continue;
+        }
+        if (is_found && entry.dev == st.st_dev && entry.ino == st.st_ino) {
+            entry.used_at = cache.clock;
+            return entry.fd;
+        }
+        output_cache_evict(i);
+        break;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    /* A FIFO reader would never see EOF while it is kept open. */
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return fd;
+    }
+    if (cache.entries.size() == OUTPUT_CACHE_SIZE) {
+        size_t lru = 0;
+        for (size_t i = 1; i < cache.entries.size(); ++i) {
+            if (cache.entries[i].used_at < cache.entries[lru].used_at) {
+                lru = i;
+            }
+        }
+        output_cache_evict(lru);
+    }
+    cache.entries.push_back(output_cache_entry{path, st.st_dev, st.st_ino, fd, cache.clock});
+    return fd;
+}
+
+/**
+ * Open the output file of the line. Close it with
+ * close_output_file(), since an appended file stays in the cache.
+ */
+static int
+open_output_file(const command_line& line)
+{
+    if (line.out_type == OUTPUT_TYPE_FILE_APPEND) {
+        return output_cache_open(line.out_file.data());
+    }
+    return open(line.out_file.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+}
+
+static void
+close_output_file(int fd)
+{
+    for (const output_cache_entry& entry : output_files.entries) {
+        if (entry.fd == fd) {
+            return;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * Open the input of the line's first command. The text of <<< or a
+ * heredoc is written into a memfd instead of being fed by a `cat`
+ * through a pipe: it doesn't need a writer running alongside, and
+ * the command gets a regular file it can seek or map. Returns -1
+ * after reporting an error.
+ */
+static int
+open_input_file(const command_line& line)
+{
+    if (line.in_type == INPUT_TYPE_FILE) {
+        int fd = open(line.in_source.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(line.in_source.data());
+        }
+        return fd;
+    }
+    int fd = memfd_create("mybash-input", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    std::string_view text = line.in_source;
+    while (!text.empty()) {
+        ssize_t rc = write(fd, text.data(), text.size());
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc < 0) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        text.remove_prefix(rc);
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+
+static std::string
+get_path_env()
+{
+    const std::string* path = variable_find("PATH");
+    /* The same default as execvp() has. */
+    return path ? *path : std::string("/bin:/usr/bin");
+}
+
+/**
+ * Find the program in PATH like execvp() does, but with a stat() per
+ * entry instead of a failed execve().
+ *
+ * @retval 0 Found, @a result is set.
+ * @retval errno The error execvp() would give.
+ */
+static int
+search_path(std::string_view name, const std::string& path_env, std::string& result)
+{
+    int err = ENOENT;
+    size_t pos = 0;
+    while (pos <= path_env.size()) {
+        size_t end = path_env.find(':', pos);
+        if (end == std::string::npos) {
+            end = path_env.size();
+        }
+        /* An empty entry means the current directory. */
+        std::string candidate = end == pos ? std::string(".") :
+                                path_env.substr(pos, end - pos);
+        candidate += '/';
+        candidate += name;
+        pos = end + 1;
+
+        struct stat st;
+        if (stat(candidate.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (access(candidate.c_str(), X_OK) != 0) {
+            err = EACCES;
+            continue;
+        }
+        result = std::move(candidate);
+        return 0;
+    }
+    return err;
+}
+
+/**
+ * Get the path to execute the command with. Names with a slash are
+ * used as is, the others are looked up in the cache first.
+ *
+ * @retval 0 Success, @a result is set.
+ * @retval errno The command is not found.
+ */
+static int
+resolve_command(std::string_view name, std::string& result)
+{
+    if (name.find('/') != std::string_view::npos) {
+        result = name;
+        return 0;
+    }
+    std::string path_env = get_path_env();
+    std::lock_guard<std::mutex> guard(command_paths.mutex);
+    if (command_paths.path_env != path_env) {
+        command_paths.entries.clear();
+        command_paths.path_env = path_env;
+    }
+    std::string key(name);
+    auto it = command_paths.entries.find(key);
+    if (it != command_paths.entries.end()) {
+        ++it->second.hits;
+        result = it->second.path;
+        return 0;
+    }
+    int err = search_path(name, path_env, result);
+    if (err != 0) {
+        return err;
+    }
+    /* Relative ones would break on cd. */
+    if (result[0] == '/') {
+        command_paths.entries[key] = path_cache_entry{result, 1};
+    }
+    return 0;
+}
+
+static void
+path_cache_free()
+{
+    std::unordered_map<std::string, path_cache_entry>().swap(command_paths.entries);
+    std::string().swap(command_paths.path_env);
+}
+
+/** Drop a cached path which turned out to be stale. */
+static void
+forget_command(std::string_view name)
+{
+    std::lock_guard<std::mutex> guard(command_paths.mutex);
+    command_paths.entries.erase(std::string(name));
+}
+
+static int
+status_to_code(int status)
+{
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    } else {
+        return 1;
+    }
+}
+
+static int
+open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void
+describe_command(const command& cmd, std::string& text)
+{
+    text += cmd.exe;
+    for (const auto& arg : cmd.args) {
+        text += ' ';
+        text += arg;
+    }
+}
+
+/** Text of the command line like it would be typed, for `jobs`. */
+static std::string
+describe_command_line(const command_line& line)
+{
+    std::string text;
+    for (const expr& e : line.exprs) {
+        switch (e.type) {
+        case EXPR_TYPE_COMMAND:
+            describe_command(*e.cmd, text);
+            break;
+        case EXPR_TYPE_PIPE:
+            text += " | ";
+            break;
+        case EXPR_TYPE_AND:
+            text += " && ";
+            break;
+        case EXPR_TYPE_OR:
+            text += " || ";
+            break;
+        }
+    }
+    if (line.out_type == OUTPUT_TYPE_FILE_NEW) {
+        text += " > ";
+        text += line.out_file;
+    } else if (line.out_type == OUTPUT_TYPE_FILE_APPEND) {
+        text += " >> ";
+        text += line.out_file;
+    }
+    if (line.is_background) {
+        text += " &";
+    }
+    return text;
+}
+
+/** Add a started process to the job, and watch it. */
+static void
+job_add_process(job& j, pid_t pid)
+{
+    job_table& table = shell_jobs;
+    if (table.epoll_fd < 0) {
+        table.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    int pidfd = table.epoll_fd >= 0 ? open_pidfd(pid) : -1;
+    if (pidfd >= 0) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = j.id;
+        if (epoll_ctl(table.epoll_fd, EPOLL_CTL_ADD, pidfd, &event) != 0) {
+            close(pidfd);
+            pidfd = -1;
+        }
+    }
+    j.procs.push_back(job_process{pid, pidfd});
+    j.is_polled = j.is_polled || pidfd < 0;
+}
+
+static void
+job_process_unwatch(job_process& proc)
+{
+    if (proc.pidfd < 0) {
+        return;
+    }
+    /*
+     * A forked background job might still have a copy of the pidfd,
+     * then close() alone would leave it in the epoll set.
+     */
+    epoll_ctl(shell_jobs.epoll_fd, EPOLL_CTL_DEL, proc.pidfd, nullptr);
+    close(proc.pidfd);
+    proc.pidfd = -1;
+}
+
+/** Count the job which has just started as running, or finish it if nothing runs. */
+static void
+job_watch(job& j)
+{
+    job_table& table = shell_jobs;
+    if (j.procs.empty()) {
+        j.is_done = true;
+        ++table.done_count;
+    } else if (j.is_polled) {
+        ++table.polled_count;
+    } else {
+        ++table.watched_count;
+    }
+}
+
+/** Store the exit code, the job has no processes left. */
+static void
+job_finish(job& j, int code)
+{
+    job_table& table = shell_jobs;
+    j.is_done = true;
+    j.code = code;
+    ++table.done_count;
+    if (j.is_polled) {
+        --table.polled_count;
+    } else {
+        --table.watched_count;
+    }
+}
+
+/**
+ * Reap the exited processes of the job. The job code is the one of
+ * its last stage, but the job is done only when all of them exit,
+ * like a pipeline in the foreground.
+ *
+ * @retval true The job is done now.
+ */
+static bool
+job_try_reap(job& j, int flags)
+{
+    for (size_t i = 0; i < j.procs.size();) {
+        job_process& proc = j.procs[i];
+        int status = 0;
+        pid_t rc;
+        do {
+            rc = waitpid(proc.pid, &status, flags);
+        } while (rc < 0 && errno == EINTR);
+        if (rc == 0) {
+            ++i;
+            continue;
+        }
+        if (proc.pid == j.pid) {
+            /* Not our child anymore, nothing to report. */
+            j.code = rc < 0 ? 127 : status_to_code(status);
+        }
+        job_process_unwatch(proc);
+        proc = j.procs.back();
+        j.procs.pop_back();
+    }
+    if (!j.procs.empty()) {
+        return false;
+    }
+    job_finish(j, j.code);
+    return true;
+}
+
+static void
+job_table_erase(std::map<int, job>::iterator it)
+{
+    if (it->second.is_done) {
+        --shell_jobs.done_count;
+    }
+    shell_jobs.jobs.erase(it);
+}
+
+/**
+ * Drop the table at the shell exit, and in a forked background job,
+ * which runs like a subshell and has no jobs of its own. The running
+ * jobs are left alone.
+ */
+static void
+job_table_forget()
+{
+    job_table& table = shell_jobs;
+    for (auto& [id, j] : table.jobs) {
+        for (job_process& proc : j.procs) {
+            if (proc.pidfd >= 0) {
+                close(proc.pidfd);
+            }
+        }
+        if (j.line != nullptr) {
+            command_line_delete(j.line);
+        }
+    }
+    if (table.epoll_fd >= 0) {
+        close(table.epoll_fd);
+    }
+    table = job_table();
+}
+
+static void
+job_launch(job& j)
+{
+    command_line* line = j.line;
+    int last_status = j.last_status;
+    j.line = nullptr;
+    /* The code if nothing starts. */
+    j.code = 1;
+    std::vector<pid_t> pids;
+    if (start_background_pipeline(*line, last_status, pids, j.pid, j.code)) {
+        command_line_delete(line);
+        for (pid_t pid : pids) {
+            job_add_process(j, pid);
+        }
+        job_watch(j);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        job_table_forget();
+        run_command_sequence(line, last_status, false);
+        _exit(last_status);
+    }
+    command_line_delete(line);
+    if (pid < 0) {
+        perror("fork");
+    } else {
+        j.pid = pid;
+        job_add_process(j, pid);
+    }
+    job_watch(j);
+}
+
+/**
+ * Start the job. While a stdin script runs, the jobs get /dev/null
+ * as stdin like in bash, so they don't read the script concurrently
+ * with the shell.
+ */
+static void
+job_start(job& j)
+{
+    off_t line_end = stdin_line_end;
+    int saved_stdin = -1;
+    if (line_end >= 0) {
+        int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null_fd >= 0) {
+            saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+            stdin_line_end = -1;
+        }
+    }
+    job_launch(j);
+    if (saved_stdin >= 0) {
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+        stdin_line_end = line_end;
+    }
+}
+
+/** Start the queued jobs while there are free slots. */
+static void
+job_table_schedule()
+{
+    job_table& table = shell_jobs;
+    while (!table.queue.empty() &&
+           (options.max_jobs == 0 ||
+            table.watched_count + table.polled_count < options.max_jobs)) {
+        auto it = table.jobs.find(*table.queue.begin());
+        table.queue.erase(table.queue.begin());
+        job_start(it->second);
+    }
+}
+
+/**
+ * Queue a background line. It starts right away if less than
+ * max_jobs jobs are running.
+ */
+static void
+job_table_push(const command_line* line, int last_status)
+{
+    job_table& table = shell_jobs;
+    job j{table.next_id++, -1, {}, false, false, false, 0, describe_command_line(*line),
+          command_line_dup(line), last_status};
+    table.queue.insert(j.id);
+    table.jobs.emplace(j.id, std::move(j));
+    job_table_schedule();
+}
+
+/**
+ * Reap the exited background jobs and start the queued ones in their
+ * place. With @a is_blocking it waits until at least one job exits,
+ * if any is running.
+ */
+static void
+job_table_reap(bool is_blocking)
+{
+    job_table& table = shell_jobs;
+    struct epoll_event events[JOB_REAP_BATCH];
+    int timeout = is_blocking ? -1 : 0;
+    bool is_reaped = false;
+    while (table.watched_count > 0) {
+        int count = epoll_wait(table.epoll_fd, events, JOB_REAP_BATCH, timeout);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        for (int i = 0; i < count; ++i) {
+            auto it = table.jobs.find((int)events[i].data.u64);
+            if (it != table.jobs.end() && !it->second.is_done) {
+                is_reaped = job_try_reap(it->second, WNOHANG) || is_reaped;
+            }
+        }
+        if (is_reaped) {
+            timeout = 0;
+        }
+        if (count < JOB_REAP_BATCH && (timeout == 0 || count < 0)) {
+            break;
+        }
+    }
+    if (table.polled_count > 0) {
+        for (auto& [id, j] : table.jobs) {
+            if (j.is_done || j.line != nullptr || !j.is_polled) {
+                continue;
+            }
+            bool is_block = is_blocking && !is_reaped;
+            is_reaped = job_try_reap(j, is_block ? 0 : WNOHANG) || is_reaped;
+        }
+    }
+    if (!is_blocking) {
+        /* Forget the oldest statuses nobody asked for. */
+        for (auto it = table.jobs.begin();
+             table.done_count > JOB_DONE_MAX && it != table.jobs.end();) {
+            if (it->second.is_done) {
+                job_table_erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+    job_table_schedule();
+}
+
+/** Let all the queued jobs start, for the shell exit. */
+static void
+job_table_drain_queue()
+{
+    while (!shell_jobs.queue.empty()) {
+        job_table_reap(true);
+    }
+}
+
+/** Find a job by `%N` or by its pid. */
+static std::map<int, job>::iterator
+job_table_find(std::string_view spec)
+{
+    auto& jobs = shell_jobs.jobs;
+    std::string str(spec);
+    char* end = nullptr;
+    bool is_id = !str.empty() && str[0] == '%';
+    const char* num = str.c_str() + (is_id ? 1 : 0);
+    long value = strtol(num, &end, 10);
+    if (end == num || *end != '\0') {
+        return jobs.end();
+    }
+    if (is_id) {
+        return jobs.find((int)value);
+    }
+    return std::find_if(jobs.begin(), jobs.end(),
+                        [&](const auto& it) { return it.second.pid == value; });
+}
+
+/**
+ * Block SIGPIPE in the current thread, so a write into a closed pipe
+ * fails with EPIPE instead of killing the shell.
+ */
+static void
+sigpipe_block(sigset_t* old_set)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, old_set);
+}
+
+/** Restore the mask, dropping the SIGPIPE raised by a failed write. */
+static void
+sigpipe_restore(const sigset_t* old_set, bool is_raised)
+{
+    if (is_raised) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        struct timespec zero = {0, 0};
+        sigtimedwait(&set, nullptr, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, old_set, nullptr);
+}
+
+/** @retval 0 / errno */
+static int
+write_all(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t rc = write(fd, data, size);
+        if (rc >= 0) {
+            data += rc;
+            size -= rc;
+        } else if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the whole builtin output. A closed reader doesn't kill the
+ * shell, the builtin gets the code of a process killed by SIGPIPE
+ * instead.
+ */
+static int
+builtin_write(int fd, const std::string& data)
+{
+    sigset_t old_set;
+    sigpipe_block(&old_set);
+    int err = write_all(fd, data.data(), data.size());
+    sigpipe_restore(&old_set, err == EPIPE);
+    if (err == EPIPE) {
+        return 128 + SIGPIPE;
+    }
+    if (err != 0) {
+        fprintf(stderr, "write error: %s\n", strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
+static bool
+is_pipe(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/** Whether splice() can write into the descriptor. */
+static bool
+is_splice_target(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    if (S_ISFIFO(st.st_mode)) {
+        return true;
+    }
+    /* splice() refuses files opened with O_APPEND. */
+    return S_ISREG(st.st_mode) && (fcntl(fd, F_GETFL) & O_APPEND) == 0;
+}
+
+/** Move exactly @a size bytes out of the pipe. @retval 0 / errno */
+static int
+splice_all(int in, int out, size_t size)
+{
+    while (size > 0) {
+        ssize_t rc = splice(in, nullptr, out, nullptr, size, SPLICE_F_MOVE);
+        if (rc > 0) {
+            size -= rc;
+        } else if (rc == 0) {
+            return EIO;
+        } else if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Relay the input pipe into the targets without copying the data to
+ * the user space. The data is duplicated by tee() for all the targets
+ * but the last one, which consumes it by splice(). The first tee() is
+ * the one to decide how much is moved per round. The other targets
+ * and all non-pipe ones are fed through the empty @a tmp pipe, which
+ * is as big as the input one, so a tee() into it never stops short.
+ *
+ * @retval 0 / errno
+ */
+static int
+tee_relay_splice(int in, const std::vector<int>& targets, const int tmp[2])
+{
+    size_t last = targets.size() - 1;
+    while (true) {
+        size_t size = TEE_CHUNK_SIZE;
+        for (size_t i = 0; i < last; ++i) {
+            bool is_direct = i == 0 && is_pipe(targets[i]);
+            int fd = is_direct ? targets[i] : tmp[1];
+            ssize_t rc;
+            do {
+                rc = tee(in, fd, size, 0);
+            } while (rc < 0 && errno == EINTR);
+            if (rc < 0) {
+                return errno;
+            }
+            if (i == 0 && rc == 0) {
+                return 0;
+            }
+            if (i != 0 && (size_t)rc != size) {
+                return EIO;
+            }
+            size = rc;
+            if (!is_direct) {
+                int err = splice_all(tmp[0], targets[i], size);
+                if (err != 0) {
+                    return err;
+                }
+            }
+        }
+        if (last != 0) {
+            int err = splice_all(in, targets[last], size);
+            if (err != 0) {
+                return err;
+            }
+            continue;
+        }
+        ssize_t rc = splice(in, nullptr, targets[last], nullptr, size, SPLICE_F_MOVE);
+        if (rc == 0) {
+            return 0;
+        }
+        if (rc < 0 && errno != EINTR) {
+            return errno;
+        }
+    }
+}
+
+/** The fallback relay for targets splice() can't handle. */
+static int
+tee_relay_copy(int in, const std::vector<int>& targets)
+{
+    std::vector<char> buf(TEE_BUFFER_SIZE);
+    while (true) {
+        ssize_t rc = read(in, buf.data(), buf.size());
+        if (rc == 0) {
+            return 0;
+        }
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        for (int fd : targets) {
+            int err = write_all(fd, buf.data(), rc);
+            if (err != 0) {
+                return err;
+            }
+        }
+    }
+}
+
+static int
+tee_relay(int in, const std::vector<int>& targets)
+{
+    bool is_zero_copy = is_pipe(in);
+    for (size_t i = 0; i < targets.size() && is_zero_copy; ++i) {
+        is_zero_copy = is_splice_target(targets[i]);
+    }
+    int tmp[2] = {-1, -1};
+    if (is_zero_copy && targets.size() > 1) {
+        int size = fcntl(in, F_GETPIPE_SZ);
+        is_zero_copy = size > 0 && pipe2(tmp, O_CLOEXEC) == 0;
+        if (is_zero_copy && fcntl(tmp[1], F_SETPIPE_SZ, size) < size) {
+            is_zero_copy = false;
+        }
+    }
+    int err = is_zero_copy ? tee_relay_splice(in, targets, tmp) :
+              tee_relay_copy(in, targets);
+    if (tmp[0] != -1) {
+        close(tmp[0]);
+        close(tmp[1]);
+    }
+    return err;
+}
+
+/** --help and --version alone are handled by the coreutils programs. */
+static bool
+has_no_info_option(const command& cmd)
+{
+    return cmd.args.size() != 1 ||
+           (cmd.args[0] != "--help" && cmd.args[0] != "--version");
+}
+
+static bool
+echo_is_applicable(const command& cmd)
+{
+    if (!has_no_info_option(cmd)) {
+        return false;
+    }
+    if (cmd.args.empty()) {
+        return true;
+    }
+    /* Options like -n or -e are left to the real echo. */
+    std::string_view arg = cmd.args[0];
+    return arg.size() < 2 || arg[0] != '-' ||
+           arg.find_first_not_of("neE", 1) != std::string_view::npos;
+}
+
+static bool
+pwd_is_applicable(const command& cmd)
+{
+    return cmd.args.empty();
+}
+
+static bool
+tee_is_applicable(const command& cmd)
+{
+    /* Options but -a are left to the real tee. */
+    for (const auto& arg : cmd.args) {
+        if (arg.size() > 1 && arg[0] == '-' && arg != "-a") {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+printenv_is_applicable(const command& cmd)
+{
+    for (const auto& arg : cmd.args) {
+        if (!arg.empty() && arg[0] == '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int
+builtin_true(const command&, const builtin_ctx&)
+{
+    return 0;
+}
+
+static int
+builtin_false(const command&, const builtin_ctx&)
+{
+    return 1;
+}
+
+static int
+builtin_echo(const command& cmd, const builtin_ctx& ctx)
+{
+    std::string out;
+    for (size_t i = 0; i < cmd.args.size(); ++i) {
+        if (i != 0) {
+            out += ' ';
+        }
+        out += cmd.args[i];
+    }
+    out += '\n';
+    return builtin_write(ctx.out_fd, out);
+}
+
+static int
+builtin_pwd(const command&, const builtin_ctx& ctx)
+{
+    char* dir = getcwd(nullptr, 0);
+    if (dir == nullptr) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    std::string out(dir);
+    free(dir);
+    out += '\n';
+    return builtin_write(ctx.out_fd, out);
+}
+
+/** getenv() of the given environment. */
+static const char*
+env_find(char* const* envp, std::string_view name)
+{
+    for (char* const* env = envp; *env != nullptr; ++env) {
+        if (strncmp(*env, name.data(), name.size()) == 0 && (*env)[name.size()] == '=') {
+            return *env + name.size() + 1;
+        }
+    }
+    return nullptr;
+}
+
+static int
+builtin_printenv(const command& cmd, const builtin_ctx& ctx)
+{
+    std::string out;
+    int code = 0;
+    if (cmd.args.empty()) {
+        for (char* const* env = ctx.envp; *env != nullptr; ++env) {
+            out += *env;
+            out += '\n';
+        }
+    }
+    for (const auto& arg : cmd.args) {
+        const char* value = nullptr;
+        if (arg.find('=') == std::string_view::npos) {
+            value = env_find(ctx.envp, arg);
+        }
+        if (value == nullptr) {
+            code = 1;
+            continue;
+        }
+        out += value;
+        out += '\n';
+    }
+    int rc = builtin_write(ctx.out_fd, out);
+    return rc != 0 ? rc : code;
+}
+
+/**
+ * `tee [-a] FILE...` copies the input to the output and the files.
+ * In a pipeline it moves the data with tee() and splice(), with no
+ * copying through the shell memory.
+ */
+static int
+builtin_tee(const command& cmd, const builtin_ctx& ctx)
+{
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+    for (const auto& arg : cmd.args) {
+        if (arg == "-a") {
+            flags = (flags & ~O_TRUNC) | O_APPEND;
+        }
+    }
+    int code = 0;
+    std::vector<int> targets{ctx.out_fd};
+    for (const auto& arg : cmd.args) {
+        if (arg == "-a") {
+            continue;
+        }
+        int fd = open(arg.data(), flags, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "tee: %s: %s\n", arg.data(), strerror(errno));
+            code = 1;
+            continue;
+        }
+        targets.push_back(fd);
+    }
+
+    sigset_t old_set;
+    sigpipe_block(&old_set);
+    int err = tee_relay(ctx.in_fd, targets);
+    sigpipe_restore(&old_set, err == EPIPE);
+    for (size_t i = 1; i < targets.size(); ++i) {
+        close(targets[i]);
+    }
+    if (err == EPIPE) {
+        return 128 + SIGPIPE;
+    }
+    if (err != 0) {
+        fprintf(stderr, "tee: %s\n", strerror(err));
+        return 1;
+    }
+    return code;
+}
+
+static int
+builtin_cd(const command& cmd, const builtin_ctx& ctx)
+{
+    return change_directory(cmd, ctx.is_piped);
+}
+
+static int
+builtin_exit(const command& cmd, const builtin_ctx& ctx)
+{
+    return get_exit_code(cmd, ctx.last_status);
+}
+
+/**
+ * `export NAME=value` sets and exports, `export NAME` exports, and
+ * `export` alone prints the exported variables.
+ */
+static int
+builtin_export(const command& cmd, const builtin_ctx& ctx)
+{
+    if (cmd.args.empty()) {
+        std::vector<std::string_view> names;
+        for (const auto& [name, var] : shell_vars.vars) {
+            if (var.is_exported) {
+                names.push_back(name);
+            }
+        }
+        std::sort(names.begin(), names.end());
+        std::string out;
+        for (std::string_view name : names) {
+            out += "export ";
+            out += name;
+            out += "=\"";
+            out += *variable_find(name);
+            out += "\"\n";
+        }
+        return builtin_write(ctx.out_fd, out);
+    }
+    int code = 0;
+    for (std::string_view arg : cmd.args) {
+        size_t eq = arg.find('=');
+        std::string_view name = arg.substr(0, eq);
+        if (!is_variable_name(name)) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", arg.data());
+            code = 1;
+        } else if (ctx.is_piped) {
+            continue;
+        } else if (eq == std::string_view::npos) {
+            variable_export(name);
+        } else {
+            variable_set(name, arg.substr(eq + 1), true);
+        }
+    }
+    return code;
+}
+
+static int
+builtin_unset(const command& cmd, const builtin_ctx& ctx)
+{
+    if (ctx.is_piped) {
+        return 0;
+    }
+    for (std::string_view name : cmd.args) {
+        variable_unset(name);
+    }
+    return 0;
+}
+
+/**
+ * `hash` prints the cached command paths, `hash -r` forgets them all,
+ * and `hash name...` looks the names up and caches them.
+ */
+static int
+builtin_hash(const command& cmd, const builtin_ctx& ctx)
+{
+    bool is_reset = false;
+    size_t first = 0;
+    for (; first < cmd.args.size() && !cmd.args[first].empty() &&
+           cmd.args[first][0] == '-'; ++first) {
+        if (cmd.args[first] != "-r") {
+            fprintf(stderr, "hash: %s: invalid option\n", cmd.args[first].data());
+            return 2;
+        }
+        is_reset = true;
+    }
+    /* A hash in a pipeline runs as if in a subshell. */
+    if (is_reset && !ctx.is_piped) {
+        std::lock_guard<std::mutex> guard(command_paths.mutex);
+        command_paths.entries.clear();
+    }
+
+    int code = 0;
+    for (size_t i = first; i < cmd.args.size(); ++i) {
+        const std::string_view& name = cmd.args[i];
+        std::string path;
+        if (name.find('/') != std::string_view::npos) {
+            continue;
+        }
+        if (resolve_command(name, path) != 0) {
+            fprintf(stderr, "hash: %s: not found\n", name.data());
+            code = 1;
+        }
+    }
+    if (is_reset || first < cmd.args.size()) {
+        return code;
+    }
+
+    std::vector<std::pair<std::string, path_cache_entry>> entries;
+    {
+        std::lock_guard<std::mutex> guard(command_paths.mutex);
+        entries.assign(command_paths.entries.begin(), command_paths.entries.end());
+    }
+    if (entries.empty()) {
+        return builtin_write(ctx.out_fd, "hash: hash table empty\n");
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::string out = "hits\tcommand\n";
+    char hits[16];
+    for (const auto& entry : entries) {
+        snprintf(hits, sizeof(hits), "%4u\t", entry.second.hits);
+        out += hits;
+        out += entry.second.path;
+        out += '\n';
+    }
+    return builtin_write(ctx.out_fd, out);
+}
+
+/** `jobs [-p]` lists the running jobs and the newly done ones. */
+static int
+builtin_jobs(const command& cmd, const builtin_ctx& ctx)
+{
+    bool is_pid_only = false;
+    for (const auto& arg : cmd.args) {
+        if (arg != "-p") {
+            fprintf(stderr, "jobs: %s: invalid option\n", arg.data());
+            return 2;
+        }
+        is_pid_only = true;
+    }
+    if (!ctx.is_piped) {
+        job_table_reap(false);
+    }
+
+    std::string out;
+    char buf[64];
+    for (auto& [id, j] : shell_jobs.jobs) {
+        if (j.is_reported) {
+            continue;
+        }
+        if (!ctx.is_piped) {
+            j.is_reported = j.is_done;
+        }
+        if (is_pid_only) {
+            snprintf(buf, sizeof(buf), "%d\n", (int)j.pid);
+            out += buf;
+            continue;
+        }
+        char state[16];
+        if (j.line != nullptr) {
+            snprintf(state, sizeof(state), "Queued");
+        } else if (!j.is_done) {
+            snprintf(state, sizeof(state), "Running");
+        } else if (j.code == 0) {
+            snprintf(state, sizeof(state), "Done");
+        } else {
+            snprintf(state, sizeof(state), "Exit %d", j.code);
+        }
+        snprintf(buf, sizeof(buf), "[%d]  %-22s  ", id, state);
+        out += buf;
+        out += j.text;
+        out += '\n';
+    }
+    return builtin_write(ctx.out_fd, out);
+}
+
+/**
+ * `wait` waits for all the background jobs including the queued ones
+ * and returns 0, `wait ID...` waits for the given jobs and returns the
+ * code of the last one. A piped `wait` runs as if in a subshell, which
+ * has no jobs.
+ */
+static int
+builtin_wait(const command& cmd, const builtin_ctx& ctx)
+{
+    job_table& table = shell_jobs;
+    auto& jobs = table.jobs;
+    if (cmd.args.empty()) {
+        if (!ctx.is_piped) {
+            while (table.watched_count + table.polled_count > 0 || !table.queue.empty()) {
+                job_table_reap(true);
+            }
+            jobs.clear();
+            table.done_count = 0;
+        }
+        return 0;
+    }
+
+    int code = 0;
+    for (const auto& arg : cmd.args) {
+        auto it = ctx.is_piped ? jobs.end() : job_table_find(arg);
+        if (it == jobs.end()) {
+            fprintf(stderr, "wait: %s: no such job\n", arg.data());
+            code = 127;
+            continue;
+        }
+        job& j = it->second;
+        while (!j.is_done) {
+            if (j.line != nullptr) {
+                /* Queued, wait for a free slot. */
+                job_table_reap(true);
+            } else {
+                job_try_reap(j, 0);
+                job_table_schedule();
+            }
+        }
+        code = j.code;
+        job_table_erase(it);
+    }
+    return code;
+}
+
+static const builtin_desc builtins[] = {
+    {"true", has_no_info_option, builtin_true},
+    {"false", has_no_info_option, builtin_false},
+    {"echo", echo_is_applicable, builtin_echo},
+    {"pwd", pwd_is_applicable, builtin_pwd},
+    {"printenv", printenv_is_applicable, builtin_printenv},
+    {"tee", tee_is_applicable, builtin_tee},
+    {"cd", nullptr, builtin_cd},
+    {"exit", nullptr, builtin_exit},
+    {"export", nullptr, builtin_export},
+    {"unset", nullptr, builtin_unset},
+    {"hash", nullptr, builtin_hash},
+    {"jobs", nullptr, builtin_jobs},
+    {"wait", nullptr, builtin_wait},
+};
+
+/**
+ * Find a builtin to run the command in the shell process instead of
+ * a new one.
+ *
+ * @retval nullptr The command has to be executed as a program.
+ */
+static const builtin_desc*
+find_builtin(const command& cmd)
+{
+    for (const builtin_desc& builtin : builtins) {
+        if (cmd.exe != builtin.name) {
+            continue;
+        }
+        if (builtin.is_applicable != nullptr && !builtin.is_applicable(cmd)) {
+            return nullptr;
+        }
+        return &builtin;
+    }
+    return nullptr;
+}
+
+static uint64_t
+clock_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+timeval_us(const struct timeval& tv)
+{
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+profile_add(profile_entry& entry, uint64_t wall_ns, const struct rusage& usage)
+{
+    ++entry.calls;
+    entry.wall_ns += wall_ns;
+    entry.user_us += timeval_us(usage.ru_utime);
+    entry.sys_us += timeval_us(usage.ru_stime);
+    entry.max_rss_kb = std::max(entry.max_rss_kb, usage.ru_maxrss);
+    entry.voluntary_switches += usage.ru_nvcsw;
+    entry.involuntary_switches += usage.ru_nivcsw;
+}
+
+/** Usage of the current thread since @a start, for a builtin stage. */
+static void
+profile_thread_usage(const struct rusage& start, struct rusage& usage)
+{
+    struct rusage now;
+    getrusage(RUSAGE_THREAD, &now);
+    usage = now;
+    timersub(&now.ru_utime, &start.ru_utime, &usage.ru_utime);
+    timersub(&now.ru_stime, &start.ru_stime, &usage.ru_stime);
+    usage.ru_nvcsw -= start.ru_nvcsw;
+    usage.ru_nivcsw -= start.ru_nivcsw;
+}
+
+static void
+profile_record(const std::vector<command>& commands, const pipeline_state& state,
+               uint64_t start_ns)
+{
+    uint64_t end_ns = start_ns;
+    struct rusage total = {};
+    std::string pipeline_text;
+    for (size_t i = 0; i < state.stages.size(); ++i) {
+        const pipeline_stage& stage = state.stages[i];
+        std::string text;
+        describe_command(commands[i], text);
+        if (i != 0) {
+            pipeline_text += " | ";
+        }
+        pipeline_text += text;
+
+        uint64_t stage_end_ns = std::max(stage.end_ns, start_ns);
+        end_ns = std::max(end_ns, stage_end_ns);
+        profile_add(shell_profile.stages[text], stage_end_ns - start_ns, stage.usage);
+        timeradd(&total.ru_utime, &stage.usage.ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &stage.usage.ru_stime, &total.ru_stime);
+        total.ru_maxrss = std::max(total.ru_maxrss, stage.usage.ru_maxrss);
+        total.ru_nvcsw += stage.usage.ru_nvcsw;
+        total.ru_nivcsw += stage.usage.ru_nivcsw;
+    }
+    profile_add(shell_profile.pipelines[pipeline_text], end_ns - start_ns, total);
+}
+
+static void
+profile_print(const char* title,
+              const std::unordered_map<std::string, profile_entry>& entries)
+{
+    std::vector<std::pair<std::string, profile_entry>> rows(entries.begin(),
+                                                            entries.end());
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+        return a.second.wall_ns > b.second.wall_ns;
+    });
+    fprintf(stderr, "%s:\n%8s %10s %10s %10s %10s %8s %8s  %s\n", title, "calls",
+            "wall_ms", "user_ms", "sys_ms", "maxrss_kb", "nvcsw", "nivcsw", "command");
+    for (const auto& [text, e] : rows) {
+        fprintf(stderr, "%8u %10.1f %10.1f %10.1f %10ld %8llu %8llu  %s\n", e.calls,
+                e.wall_ns / 1e6, e.user_us / 1e3, e.sys_us / 1e3, e.max_rss_kb,
+                (unsigned long long)e.voluntary_switches,
+                (unsigned long long)e.involuntary_switches, text.c_str());
+    }
+}
+
+/** Print the report sorted by the wall time and free the profile. */
+static void
+profile_report()
+{
+    profile_print("pipelines", shell_profile.pipelines);
+    profile_print("stages", shell_profile.stages);
+    profile().pipelines.swap(shell_profile.pipelines);
+    profile().stages.swap(shell_profile.stages);
+}
+
+static void
+builtin_thread_f(const builtin_desc* builtin, const command* cmd, builtin_ctx ctx,
+                 pipeline_stage* stage)
+{
+    struct rusage start;
+    if (options.is_profiling) {
+        getrusage(RUSAGE_THREAD, &start);
+    }
+    stage->code = builtin->run(*cmd, ctx);
+    if (options.is_profiling) {
+        profile_thread_usage(start, stage->usage);
+        stage->end_ns = clock_now_ns();
+    }
+    /* The pipe ends are closed like when a process exits. */
+    if (ctx.in_fd != STDIN_FILENO) {
+        close(ctx.in_fd);
+    }
+    close(ctx.out_fd);
+}
+
+/**
+ * Start a builtin on a helper thread, writing into the pipe. The
+ * stage owns @a in_fd and @a out_fd afterwards.
+ */
+static void
+start_builtin_thread(pipeline_stage& stage, const builtin_desc* builtin,
+                     const command& cmd, int in_fd, int out_fd, int last_status,
+                     char* const* envp)
+{
+    builtin_ctx ctx{in_fd, out_fd, last_status, true, envp};
+    try {
+        stage.thread = std::thread(builtin_thread_f, builtin, &cmd, ctx, &stage);
+    } catch (const std::system_error& e) {
+        fprintf(stderr, "thread: %s\n", e.what());
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        close(out_fd);
+        stage.code = 1;
+    }
+}
+
+/** Run a builtin which is the last stage of a pipeline in the shell. */
+static int
+run_builtin_in_shell(const builtin_desc* builtin, const command& cmd, int in_fd,
+                     bool is_piped, bool is_last_pipeline,
+                     const command_line& line, int last_status, char* const* envp)
+{
+    builtin_ctx ctx{in_fd, STDOUT_FILENO, last_status, is_piped, envp};
+    if (is_last_pipeline && line.out_type != OUTPUT_TYPE_STDOUT) {
+        ctx.out_fd = open_output_file(line);
+        if (ctx.out_fd < 0) {
+            perror("open");
+            return 1;
+        }
+    }
+    int code = builtin->run(cmd, ctx);
+    if (ctx.out_fd != STDOUT_FILENO) {
+        close_output_file(ctx.out_fd);
+    }
+    return code;
+}
+
+static int
+wait_for_stages(pipeline_state& state)
+{
+    int code = 1;
+    for (pipeline_stage& stage : state.stages) {
+        if (stage.thread.joinable()) {
+            stage.thread.join();
+        }
+        if (stage.pid < 0) {
+            code = stage.code;
+            continue;
+        }
+        int status = 0;
+        wait4(stage.pid, &status, 0, &stage.usage);
+        if (options.is_profiling) {
+            /* Stages are waited in order, so it is an upper bound. */
+            stage.end_ns = clock_now_ns();
+        }
+        code = status_to_code(status);
+    }
+    return code;
+}
+
+/**
+ * posix_spawn() the program, and run a file without a #! line with
+ * /bin/sh, like execvp() does when exec fails with ENOEXEC.
+ */
+static int
+spawn_program(pid_t& pid, const std::string& path, const posix_spawn_file_actions_t* actions,
+              const std::vector<char*>& argv, char* const* envp)
+{
+    int rc = posix_spawn(&pid, path.c_str(), actions, nullptr, argv.data(), envp);
+    if (rc != ENOEXEC) {
+        return rc;
+    }
+    std::vector<char*> sh_argv;
+    sh_argv.reserve(argv.size() + 1);
+    sh_argv.push_back(const_cast<char*>("/bin/sh"));
+    sh_argv.push_back(const_cast<char*>(path.c_str()));
+    sh_argv.insert(sh_argv.end(), argv.begin() + 1, argv.end());
+    return posix_spawn(&pid, "/bin/sh", actions, nullptr, sh_argv.data(), envp);
+}
+
+/**
+ * Start a stage which is an external program. posix_spawn() doesn't
+ * copy the page tables of the shell like fork() does, so the launch
+ * cost doesn't depend on how big the shell is. The program path is
+ * taken from the cache, so PATH isn't probed on each launch, and the
+ * environment is the cached one of the variable table. The pipes
+ * and the output file are all close-on-exec, only their dups survive
+ * exec.
+ *
+ * @retval >0 Pid of the stage.
+ * @retval -1 The stage couldn't start, @a fail_code is set.
+ */
+static pid_t
+spawn_stage(const command& cmd, char* const* envp, int current_input, int pipefd[2],
+            bool is_last_pipeline, const command_line& line, int& fail_code)
+{
+    int out_fd = -1;
+    if (pipefd[1] == -1 && is_last_pipeline && line.out_type != OUTPUT_TYPE_STDOUT) {
+        out_fd = open_output_file(line);
+        if (out_fd < 0) {
+            perror("open");
+            fail_code = 1;
+            return -1;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (current_input != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, current_input, STDIN_FILENO);
+    } else {
+        stdin_sync();
+    }
+    if (pipefd[1] != -1) {
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    } else if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+
+    std::vector<char*> argv = make_argv(cmd);
+    pid_t pid = -1;
+    std::string path;
+    int rc = resolve_command(cmd.exe, path);
+    if (rc == 0) {
+        rc = spawn_program(pid, path, &actions, argv, envp);
+    }
+    if (rc == ENOENT && path[0] == '/' && path != cmd.exe) {
+        /* The program was moved since it got cached. */
+        forget_command(cmd.exe);
+        rc = resolve_command(cmd.exe, path);
+        if (rc == 0) {
+            rc = spawn_program(pid, path, &actions, argv, envp);
+        }
+    }
+    if (rc == ETXTBSY && output_cache_drop_except(out_fd)) {
+        /* The program was written by >> and was still open in the cache. */
+        rc = spawn_program(pid, path, &actions, argv, envp);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (out_fd != -1) {
+        close_output_file(out_fd);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "execvp: %s\n", strerror(rc));
+        fail_code = 127;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Output of the command substitutions of a pipeline, and the words
+ * made of it. The output stays where the subshells wrote it, and a
+ * word which is a whole substitution points right into it.
+ */
+struct expansion_state {
+    std::vector<std::pair<char*, size_t>> maps;
+    std::deque<std::string> words;
+    std::deque<std::vector<std::string_view>> fields;
+    /** Environments of the commands with their own assignments. */
+    std::deque<std::vector<char*>> envps;
+
+    ~expansion_state()
+    {
+        for (auto& [data, size] : maps) {
+            munmap(data, size);
+        }
+    }
+};
+
+/** Run a script in a forked shell, like $(...) does. */
+static int
+run_subshell(std::string_view script, int last_status)
+{
+    struct parser* p = parser_new();
+    parser_feed(p, script.data(), script.size());
+    parser_feed(p, "\n", 1);
+    execute_parsed_lines(p, last_status, nullptr);
+    parser_delete(p);
+    fflush(stdout);
+    return last_status;
+}
+
+/**
+ * Run the command of a substitution with the output going into a
+ * memfd, and map it instead of reading it through a pipe. The
+ * trailing new lines are cut off as POSIX says. The file gets one
+ * more zero byte, so the output is a C string in place, and the
+ * mapping is private: cutting the new lines or splitting the fields
+ * copies just the pages it writes zeros to.
+ */
+static std::string_view
+capture_output(std::string_view script, int last_status, expansion_state& state)
+{
+    int fd = memfd_create("mybash-subst", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return "";
+    }
+    fflush(stdout);
+    stdin_sync();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fd, STDOUT_FILENO);
+        job_table_forget();
+        _exit(run_subshell(script, last_status));
+    }
+    if (pid < 0) {
+        perror("fork");
+        close(fd);
+        return "";
+    }
+    while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || ftruncate(fd, st.st_size + 1) != 0) {
+        close(fd);
+        return "";
+    }
+    size_t size = st.st_size;
+    void* map = mmap(nullptr, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return "";
+    }
+    state.maps.emplace_back((char*)map, size + 1);
+    char* data = (char*)map;
+    if (data[size - 1] == '\n') {
+        while (size > 0 && data[size - 1] == '\n') {
+            --size;
+        }
+        data[size] = 0;
+    }
+    return std::string_view(data, size);
+}
+
+static inline bool
+is_field_separator(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+/**
+ * Split the output of an unquoted substitution into fields by the
+ * default IFS. The separators in the mapping are overwritten with
+ * zeros, so the fields are C strings in place.
+ */
+static void
+split_fields(std::string_view out, std::vector<std::string_view>& fields)
+{
+    char* data = const_cast<char*>(out.data());
+    size_t i = 0;
+    while (i < out.size()) {
+        if (is_field_separator(data[i])) {
+            ++i;
+            continue;
+        }
+        size_t begin = i;
+        while (i < out.size() && !is_field_separator(data[i])) {
+            ++i;
+        }
+        fields.emplace_back(data + begin, i - begin);
+        if (i < out.size()) {
+            data[i++] = 0;
+        }
+    }
+}
+
+/**
+ * Value of an expansion, a C string. The output of a substitution
+ * can be changed in place, a variable value belongs to the table.
+ */
+static std::string_view
+expansion_value(const expansion& x, int last_status, expansion_state& state)
 {
-    if (pipefd[0] != -1) {
-        close(pipefd[0]);
-    }
-    if (pipefd[1] != -1) {
-        close(pipefd[1]);
+    if (x.type == EXPANSION_TYPE_COMMAND) {
+        return capture_output(x.text, last_status, state);
     }
-    if (current_input != STDIN_FILENO) {
-        close(current_input);
+    if (x.text == "?") {
+        return state.words.emplace_back(std::to_string(last_status));
     }
+    const std::string* value = variable_find(x.text);
+    return value != nullptr ? std::string_view(*value) : std::string_view("");
 }
 
+/**
+ * Expand a word with substitutions and variables into fields. A word
+ * which is one expansion and nothing else gets the fields right in
+ * its value, the others are built as new strings. An assignment is
+ * not split.
+ */
 static void
-setup_child_redirection(int current_input, int pipefd[2], bool is_last_pipeline,
-                        const command_line& line)
+expand_word(std::string_view text, const expansion* begin, const expansion* end,
+            bool is_assignment, int last_status, expansion_state& state,
+            std::vector<std::string_view>& fields)
 {
-    if (current_input != STDIN_FILENO) {
-        dup2(current_input, STDIN_FILENO);
+    if (end - begin == 1 && text.empty()) {
+        std::string_view out = expansion_value(*begin, last_status, state);
+        if (begin->is_quoted) {
+            fields.push_back(out);
+            return;
+        }
+        if (begin->type == EXPANSION_TYPE_VARIABLE &&
+            std::find_if(out.begin(), out.end(), is_field_separator) != out.end()) {
+            /* The separators are zeroed, so the table value is copied. */
+            out = state.words.emplace_back(out);
+        }
+        split_fields(out, fields);
+        return;
     }
-    if (pipefd[1] != -1) {
-        dup2(pipefd[1], STDOUT_FILENO);
-    } else if (is_last_pipeline && line.out_type != OUTPUT_TYPE_STDOUT) {
-        int flags = O_WRONLY | O_CREAT;
-        if (line.out_type == OUTPUT_TYPE_FILE_NEW) {
-            flags |= O_TRUNC;
-        } else {
-            flags |= O_APPEND;
+    std::string word;
+    bool has_word = false;
+    size_t prev = 0;
+    auto add_field = [&]() {
+        state.words.push_back(std::move(word));
+        fields.push_back(state.words.back());
+        word.clear();
+        has_word = false;
+    };
+    for (const expansion* x = begin; x != end; ++x) {
+        if (x->pos > prev) {
+            word.append(text.substr(prev, x->pos - prev));
+            has_word = true;
         }
-        int fd = open(line.out_file.c_str(), flags, 0666);
-        if (fd < 0) {
-            perror("open");
-            _exit(1);
+        prev = x->pos;
+        std::string_view out = expansion_value(*x, last_status, state);
+        if (x->is_quoted || is_assignment) {
+            word.append(out);
+            has_word = true;
+            continue;
+        }
+        for (size_t i = 0; i < out.size();) {
+            if (is_field_separator(out[i])) {
+                if (has_word) {
+                    add_field();
+                }
+                ++i;
+                continue;
+            }
+            size_t field_end = i;
+            while (field_end < out.size() && !is_field_separator(out[field_end])) {
+                ++field_end;
+            }
+            word.append(out.substr(i, field_end - i));
+            has_word = true;
+            i = field_end;
         }
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+    }
+    if (prev < text.size()) {
+        word.append(text.substr(prev));
+        has_word = true;
+    }
+    if (has_word) {
+        add_field();
     }
 }
 
-static void
-execute_child_command(const command& cmd, int last_status)
+static std::string_view
+command_word(const command& cmd, uint32_t word)
 {
-    if (cmd.exe == "cd") {
-        int rc = change_directory(cmd);
-        _exit(rc);
-    }
-    if (cmd.exe == "exit") {
-        int code = get_exit_code(cmd, last_status);
-        _exit(code);
-    }
-    std::vector<char*> argv = make_argv(cmd);
-    execvp(argv[0], argv.data());
-    perror("execvp");
-    _exit(127);
+    return word == 0 ? cmd.exe : cmd.args[word - 1];
 }
 
-static int
-wait_for_processes(const std::vector<pid_t>& process_ids)
+/**
+ * Run the substitutions of a command, take the variable values, and
+ * make the command of the fields they give. The first
+ * @a assignment_count words are assignments. The result lives as long
+ * as @a state.
+ */
+static command
+expand_command(const command& cmd, uint32_t assignment_count, int last_status,
+               expansion_state& state)
 {
-    int last_status = 0;
-    for (size_t i = 0; i < process_ids.size(); ++i) {
-        int status = 0;
-        waitpid(process_ids[i], &status, 0);
-        if (i + 1 == process_ids.size()) {
-            last_status = status;
+    std::vector<std::string_view>& fields = state.fields.emplace_back();
+    const expansion* x = cmd.expansions.begin();
+    for (uint32_t word = 0; word <= cmd.args.size(); ++word) {
+        std::string_view text = command_word(cmd, word);
+        const expansion* first = x;
+        while (x != cmd.expansions.end() && x->word == word) {
+            ++x;
+        }
+        if (first == x) {
+            fields.push_back(text);
+        } else {
+            expand_word(text, first, x, word < assignment_count, last_status, state,
+                        fields);
         }
     }
-
-    if (WIFEXITED(last_status)) {
-        return WEXITSTATUS(last_status);
-    } else if (WIFSIGNALED(last_status)) {
-        return 128 + WTERMSIG(last_status);
-    } else {
-        return 1;
+    if (fields.empty()) {
+        /* Nothing is left to run. */
+        fields.push_back("true");
     }
+    command res;
+    res.exe = fields[0];
+    res.args.data = fields.data() + 1;
+    res.args.count = fields.size() - 1;
+    return res;
 }
 
-static exec_result
-handle_single_builtin(const command& cmd, const command_line& line,
-                      bool is_last_pipeline, bool allow_exit, int last_status)
+/**
+ * Number of the words NAME=value the command starts with. It is
+ * decided before the expansions, so a value which only turns into
+ * NAME=value after them is a usual word.
+ */
+static uint32_t
+count_assignments(const command& cmd)
 {
-    exec_result result{};
+    const expansion* x = cmd.expansions.begin();
+    for (uint32_t word = 0; word <= cmd.args.size(); ++word) {
+        std::string_view text = command_word(cmd, word);
+        size_t eq = text.find('=');
+        if (eq == std::string_view::npos || !is_variable_name(text.substr(0, eq))) {
+            return word;
+        }
+        while (x != cmd.expansions.end() && x->word < word) {
+            ++x;
+        }
+        if (x != cmd.expansions.end() && x->word == word && x->pos <= eq) {
+            /* The name is expanded. */
+            return word;
+        }
+    }
+    return cmd.args.size() + 1;
+}
 
-    if (cmd.exe == "exit" && allow_exit && line.out_type == OUTPUT_TYPE_STDOUT) {
-        result.code = get_exit_code(cmd, last_status);
-        result.should_exit = true;
-        return result;
+/** Set the variables of a command which is only assignments. */
+static void
+assign_variables(const command& cmd)
+{
+    for (uint32_t word = 0; word <= cmd.args.size(); ++word) {
+        std::string_view text = command_word(cmd, word);
+        size_t eq = text.find('=');
+        variable_set(text.substr(0, eq), text.substr(eq + 1), false);
     }
+}
 
-    if (cmd.exe == "cd") {
-        int saved_stdout = -1;
-        int fd = -1;
-        if (is_last_pipeline && line.out_type != OUTPUT_TYPE_STDOUT) {
-            int flags = O_WRONLY | O_CREAT;
-            if (line.out_type == OUTPUT_TYPE_FILE_NEW) {
-                flags |= O_TRUNC;
-            } else {
-                flags |= O_APPEND;
-            }
-            fd = open(line.out_file.c_str(), flags, 0666);
-            if (fd < 0) {
-                perror("open");
-                result.code = 1;
-                return result;
+/**
+ * Environment of a command with assignments in front of it. Only such
+ * commands pay for a copy of the environment, the others get the
+ * cached one. The result lives as long as @a state.
+ */
+static char**
+make_command_envp(const command& cmd, uint32_t assignment_count, expansion_state& state)
+{
+    std::vector<char*>& envp = state.envps.emplace_back();
+    auto is_assigned = [&](std::string_view name, uint32_t first) {
+        for (uint32_t word = first; word < assignment_count; ++word) {
+            std::string_view text = command_word(cmd, word);
+            if (text.substr(0, text.find('=')) == name) {
+                return true;
             }
-            saved_stdout = dup(STDOUT_FILENO);
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
         }
-        result.code = change_directory(cmd);
-        if (saved_stdout != -1) {
-            dup2(saved_stdout, STDOUT_FILENO);
-            close(saved_stdout);
+        return false;
+    };
+    for (uint32_t word = 0; word < assignment_count; ++word) {
+        std::string_view text = command_word(cmd, word);
+        /* The last assignment of a name wins. */
+        if (!is_assigned(text.substr(0, text.find('=')), word + 1)) {
+            envp.push_back(const_cast<char*>(text.data()));
         }
-        return result;
     }
-
-    return result;
+    for (char** env = variable_table_envp(); *env != nullptr; ++env) {
+        std::string_view str(*env);
+        if (!is_assigned(str.substr(0, str.find('=')), 0)) {
+            envp.push_back(*env);
+        }
+    }
+    envp.push_back(nullptr);
+    return envp.data();
 }
 
-static exec_result
-execute_pipeline(const std::vector<command>& commands, const command_line& line,
-                 bool is_last_pipeline, bool allow_exit, int last_status)
+/** The command without the assignments in front of it. */
+static command
+strip_assignments(const command& cmd, uint32_t assignment_count)
 {
-    exec_result result{};
+    command res;
+    res.exe = cmd.args[assignment_count - 1];
+    res.args.data = cmd.args.data + assignment_count;
+    res.args.count = cmd.args.count - assignment_count;
+    return res;
+}
 
-    if (commands.size() == 1) {
-        exec_result builtin_result = handle_single_builtin(commands[0], line,
-                                                           is_last_pipeline, allow_exit, last_status);
-        if (builtin_result.should_exit || commands[0].exe == "cd") {
-            return builtin_result;
+/**
+ * Expand the commands of the pipeline. It is done before any stage
+ * starts. Returns the assignment counts of the commands.
+ */
+static std::vector<uint32_t>
+expand_pipeline(std::vector<command>& commands, int last_status, expansion_state& expansions)
+{
+    std::vector<uint32_t> assignment_counts(commands.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        assignment_counts[i] = count_assignments(commands[i]);
+        if (!commands[i].expansions.empty()) {
+            commands[i] = expand_command(commands[i], assignment_counts[i], last_status,
+                                         expansions);
         }
     }
+    return assignment_counts;
+}
 
-    pipeline_state state;
+/**
+ * Start the stages of the expanded pipeline. The programs are left
+ * running, the builtins run in the shell or on their threads. A
+ * stage which couldn't start has its code in @a state, and if a pipe
+ * couldn't be created, the stages after it are missing.
+ *
+ * @retval false The input of the line couldn't be opened, nothing
+ *         is started.
+ */
+static bool
+start_pipeline(std::vector<command>& commands, const std::vector<uint32_t>& assignment_counts,
+               expansion_state& expansions, const command_line& line,
+               bool is_first_pipeline, bool is_last_pipeline, int last_status,
+               pipeline_state& state)
+{
+    bool is_piped = commands.size() > 1;
+    state.stages.reserve(commands.size());
+    if (is_first_pipeline && line.in_type != INPUT_TYPE_STDIN) {
+        /* It is handed over and closed like a pipe from a previous stage. */
+        state.current_input = open_input_file(line);
+        if (state.current_input < 0) {
+            return false;
+        }
+    }
 
     for (size_t i = 0; i < commands.size(); ++i) {
+        /*
+         * Close-on-exec, so neither the spawned stages nor the pipes
+         * held by the helper threads leak into other stages.
+         */
         int pipefd[2] = {-1, -1};
         if (i + 1 < commands.size()) {
-            if (pipe(pipefd) != 0) {
+            if (pipe2(pipefd, O_CLOEXEC) != 0) {
                 perror("pipe");
-                result.code = 1;
-                return result;
+                break;
+            }
+            /* The kernel can refuse it, the default size stays then. */
+            if (options.pipe_size > 0) {
+                fcntl(pipefd[1], F_SETPIPE_SZ, options.pipe_size);
             }
         }
 
-        pid_t pid = fork();
-        if (pid == 0) {
-            setup_child_redirection(state.current_input, pipefd, is_last_pipeline, line);
-            close_pipe_descriptors(pipefd, state.current_input);
-            execute_child_command(commands[i], last_status);
+        state.stages.emplace_back();
+        pipeline_stage& stage = state.stages.back();
+        bool is_assignment = assignment_counts[i] > commands[i].args.size();
+        char** envp = variable_table_envp();
+        if (!is_assignment && assignment_counts[i] > 0) {
+            envp = make_command_envp(commands[i], assignment_counts[i], expansions);
+            commands[i] = strip_assignments(commands[i], assignment_counts[i]);
         }
-
-        if (pid < 0) {
-            perror("fork");
-            result.code = 1;
-            close_pipe_descriptors(pipefd, state.current_input);
-            return result;
+        const builtin_desc* builtin = is_assignment ? nullptr : find_builtin(commands[i]);
+        if (is_assignment) {
+            /* Like a builtin, it doesn't change the shell from a pipeline. */
+            if (!is_piped) {
+                assign_variables(commands[i]);
+            }
+            stage.code = 0;
+        } else if (builtin == nullptr) {
+            stage.pid = spawn_stage(commands[i], envp, state.current_input, pipefd,
+                                    is_last_pipeline, line, stage.code);
+        } else if (pipefd[1] != -1) {
+            start_builtin_thread(stage, builtin, commands[i], state.current_input,
+                                 pipefd[1], last_status, envp);
+            /* The thread owns them now. */
+            state.current_input = STDIN_FILENO;
+            pipefd[1] = -1;
+        } else {
+            struct rusage start;
+            if (options.is_profiling) {
+                getrusage(RUSAGE_THREAD, &start);
+            }
+            stage.code = run_builtin_in_shell(builtin, commands[i], state.current_input,
+                                              is_piped, is_last_pipeline, line,
+                                              last_status, envp);
+            if (options.is_profiling) {
+                profile_thread_usage(start, stage.usage);
+                stage.end_ns = clock_now_ns();
+            }
         }
 
-        state.process_ids.push_back(pid);
         if (state.current_input != STDIN_FILENO) {
             close(state.current_input);
         }
@@ -284,14 +2504,46 @@ execute_pipeline(const std::vector<command>& commands, const command_line& line,
     if (state.current_input != STDIN_FILENO && state.current_input != -1) {
         close(state.current_input);
     }
+    return true;
+}
+
+static exec_result
+execute_pipeline(std::vector<command>& commands, const command_line& line,
+                 bool is_first_pipeline, bool is_last_pipeline, bool allow_exit,
+                 int last_status)
+{
+    exec_result result{};
+    expansion_state expansions;
+    std::vector<uint32_t> assignment_counts = expand_pipeline(commands, last_status,
+                                                              expansions);
+
+    if (commands.size() == 1 && commands[0].exe == "exit" && allow_exit &&
+        line.out_type == OUTPUT_TYPE_STDOUT) {
+        result.code = get_exit_code(commands[0], last_status);
+        result.should_exit = true;
+        return result;
+    }
 
-    result.code = wait_for_processes(state.process_ids);
+    uint64_t start_ns = options.is_profiling ? clock_now_ns() : 0;
+    pipeline_state state;
+    if (!start_pipeline(commands, assignment_counts, expansions, line, is_first_pipeline,
+                        is_last_pipeline, last_status, state)) {
+        result.code = 1;
+        return result;
+    }
+    result.code = wait_for_stages(state);
+    if (options.is_profiling) {
+        profile_record(commands, state, start_ns);
+    }
+    if (state.stages.size() < commands.size()) {
+        /* Couldn't create a pipe. */
+        result.code = 1;
+    }
     return result;
 }
 
 static std::vector<command>
-parse_pipeline_commands(std::list<struct expr>::const_iterator& it,
-                        const std::list<struct expr>::const_iterator& end)
+parse_pipeline_commands(const struct expr*& it, const struct expr* end)
 {
     std::vector<command> pipeline;
 
@@ -312,12 +2564,68 @@ parse_pipeline_commands(std::list<struct expr>::const_iterator& it,
     return pipeline;
 }
 
+/**
+ * Start a background line right from the shell, with no forked shell
+ * waiting for it, if it is a single pipeline of programs. Builtins,
+ * assignments and $(...) need a shell to run in. So do the && and ||
+ * chains, which have to go on after the shell exits.
+ *
+ * @a pids gets the started stages. @a last_pid is the last stage,
+ * which gives the code of the job, or -1 if it didn't start and the
+ * code is @a code.
+ *
+ * @retval false The line needs a forked shell, nothing is started.
+ */
+static bool
+start_background_pipeline(const command_line& line, int last_status, std::vector<pid_t>& pids,
+                          pid_t& last_pid, int& code)
+{
+    for (const expr& e : line.exprs) {
+        if (e.type == EXPR_TYPE_AND || e.type == EXPR_TYPE_OR) {
+            return false;
+        }
+        if (e.type != EXPR_TYPE_COMMAND) {
+            continue;
+        }
+        const command& cmd = *e.cmd;
+        if (cmd.exe == "exit" || count_assignments(cmd) > 0 || find_builtin(cmd) != nullptr) {
+            return false;
+        }
+        for (const expansion& x : cmd.expansions) {
+            /* The program name has to be known to tell it isn't a builtin. */
+            if (x.type == EXPANSION_TYPE_COMMAND || x.word == 0) {
+                return false;
+            }
+        }
+    }
+    const struct expr* it = line.exprs.begin();
+    std::vector<command> commands = parse_pipeline_commands(it, line.exprs.end());
+    expansion_state expansions;
+    std::vector<uint32_t> assignment_counts = expand_pipeline(commands, last_status,
+                                                              expansions);
+    pipeline_state state;
+    bool is_started = start_pipeline(commands, assignment_counts, expansions, line, true, true,
+                                     last_status, state);
+    last_pid = -1;
+    code = 1;
+    for (const pipeline_stage& stage : state.stages) {
+        if (stage.pid > 0) {
+            pids.push_back(stage.pid);
+        }
+    }
+    if (is_started && state.stages.size() == commands.size()) {
+        last_pid = state.stages.back().pid;
+        code = state.stages.back().code;
+    }
+    return true;
+}
+
 static parsed_sequence
 parse_command_sequence(const command_line* line)
 {
     parsed_sequence result;
-    auto it = line->exprs.begin();
-    const auto end = line->exprs.end();
+    const struct expr* it = line->exprs.begin();
+    const struct expr* end = line->exprs.end();
 
     for (; it != end;) {
         std::vector<command> pipeline = parse_pipeline_commands(it, end);
@@ -334,18 +2642,6 @@ parse_command_sequence(const command_line* line)
     return result;
 }
 
-static void
-cleanup_background(std::vector<pid_t>& background)
-{
-    auto new_end = std::remove_if(background.begin(), background.end(),
-                                  [](pid_t pid) {
-                                      int st = 0;
-                                      pid_t res = waitpid(pid, &st, WNOHANG);
-                                      return res != 0;
-                                  });
-    background.erase(new_end, background.end());
-}
-
 static bool
 run_command_sequence(const command_line* line, int& last_status, bool allow_exit)
 {
@@ -370,7 +2666,8 @@ run_command_sequence(const command_line* line, int& last_status, bool allow_exit
         }
 
         bool is_last = (std::next(pipeline_it) == parsed.pipelines.end());
-        exec_result res = execute_pipeline(*pipeline_it, *line, is_last, allow_exit, current_status);
+        exec_result res = execute_pipeline(*pipeline_it, *line, i == 0, is_last, allow_exit,
+                                           current_status);
         current_status = res.code;
 
         if (res.should_exit) {
@@ -388,80 +2685,504 @@ run_command_sequence(const command_line* line, int& last_status, bool allow_exit
 }
 
 static bool
-execute_background_command(const struct command_line* line, int last_status,
-                           std::vector<pid_t>& bg_processes)
+process_command_line(const struct command_line* line, int& last_status)
 {
-    pid_t pid = fork();
-    if (pid == 0) {
-        int child_status = last_status;
-        run_command_sequence(line, child_status, false);
-        _exit(child_status);
+    if (line->is_background) {
+        job_table_push(line, last_status);
+        last_status = 0;
+        return false;
     }
-    if (pid < 0) {
-        perror("fork");
+    return run_command_sequence(line, last_status, true);
+}
+
+/**
+ * Execute all the complete lines fed into the parser. Returns true
+ * when the shell has to exit. With @a script the parser is fed with
+ * the script file of stdin. Then the processes of each line get
+ * stdin right after the line, like in bash, so they can read the
+ * rest of the script. If they do, it stops with script->is_moved,
+ * as the lines after the new offset are to be parsed again.
+ */
+static bool
+execute_parsed_lines(struct parser* p, int& last_status, stdin_script* script)
+{
+    struct command_line* line = NULL;
+    while (true) {
+        enum parser_error err = parser_pop_next(p, &line);
+        if (err == PARSER_ERR_NONE && line == NULL) {
+            return false;
+        }
+        if (err != PARSER_ERR_NONE) {
+            printf("Error: %d\n", (int)err);
+            continue;
+        }
+        if (script != nullptr) {
+            stdin_line_end = script->offset + (off_t)parser_consumed(p);
+            is_stdin_at_line_end = false;
+        }
+
+        bool should_exit = process_command_line(line, last_status);
+        job_table_reap(false);
+        if (should_exit) {
+            return true;
+        }
+        if (script != nullptr && is_stdin_at_line_end) {
+            off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            if (offset >= 0 && offset != stdin_line_end) {
+                script->offset = offset;
+                script->is_moved = true;
+                return false;
+            }
+        }
+    }
+}
+
+/**
+ * Execute what is left when the input is over. A heredoc without its
+ * end line is ended by the input end, with a warning like in bash.
+ */
+static bool
+execute_input_end(struct parser* p, int& last_status)
+{
+    const char* heredoc_end = parser_feed_end(p);
+    if (heredoc_end != nullptr) {
+        fprintf(stderr, "warning: here-document delimited by end-of-file (wanted `%s')\n",
+                heredoc_end);
+    }
+    return execute_parsed_lines(p, last_status, nullptr);
+}
+
+/**
+ * Map the script when stdin is a regular file, so it is parsed in
+ * place without read() calls and copies. The stdin offset is kept
+ * right after the running line, so the commands reading stdin get
+ * the rest of the script, and then moved past the mapped part for
+ * the read loop. @a offset is where the not yet read part starts
+ * in the mapping.
+ */
+static void*
+map_stdin(size_t& size, off_t& offset)
+{
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return MAP_FAILED;
+    }
+    offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (offset < 0 || offset >= st.st_size) {
+        return MAP_FAILED;
+    }
+    void* res = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (res == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    madvise(res, st.st_size, MADV_SEQUENTIAL);
+    size = st.st_size;
+    return res;
+}
+
+/** Compiled form of the script being run, see --script-cache. */
+struct script_cache {
+    void* map = MAP_FAILED;
+    size_t map_size = 0;
+    /** Freshly compiled form, when the stored one didn't fit. */
+    std::string data;
+};
+
+/**
+ * The cache of a script is stored next to it, like "run.sh.cache".
+ * A script without a name, like a deleted one, isn't cached.
+ */
+static bool
+script_cache_path(std::string& path)
+{
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) != 0 || st.st_nlink == 0) {
+        return false;
+    }
+    char buf[PATH_MAX];
+    ssize_t len = readlink("/proc/self/fd/0", buf, sizeof(buf));
+    if (len <= 0 || len == sizeof(buf) || buf[0] != '/') {
         return false;
     }
-    bg_processes.push_back(pid);
+    path.assign(buf, len);
+    path += ".cache";
     return true;
 }
 
+/**
+ * Replace the stored cache. It is written aside and renamed, so the
+ * shells running the same script never see a half-written file.
+ * Failures are ignored, the cache is only an optimization.
+ */
+static void
+script_cache_store(const std::string& path, const std::string& data)
+{
+    std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    int err = write_all(fd, data.data(), data.size());
+    if (close(fd) != 0 || err != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+    }
+}
+
+/**
+ * Feed the script through its stored compiled form if it is up to
+ * date, so its lines aren't parsed. Otherwise compile the script
+ * and store the result for the next runs.
+ */
 static bool
-process_command_line(const struct command_line* line, int& last_status,
-                     std::vector<pid_t>& bg_processes)
+script_cache_feed(struct parser* p, const char* script, size_t size, script_cache& cache)
 {
-    if (line->is_background) {
-        bool success = execute_background_command(line, last_status, bg_processes);
-        if (success) {
-            last_status = 0;
-        } else {
-            last_status = 1;
-        }
+    std::string path;
+    if (!script_cache_path(path)) {
         return false;
     }
-    return run_command_sequence(line, last_status, true);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED &&
+                parser_feed_compiled(p, (const char*)map, st.st_size, script, size)) {
+                cache.map = map;
+                cache.map_size = st.st_size;
+                close(fd);
+                return true;
+            }
+            if (map != MAP_FAILED) {
+                munmap(map, st.st_size);
+            }
+        }
+        close(fd);
+    }
+    parser_compile(script, size, &cache.data);
+    script_cache_store(path, cache.data);
+    return parser_feed_compiled(p, cache.data.data(), cache.data.size(), script, size);
 }
 
 static int
 run_shell_loop()
 {
-    const size_t buf_size = 1024;
-    char buf[buf_size];
-    int bytes_read;
     struct parser* p = parser_new();
     int last_status = 0;
-    std::vector<pid_t> bg_processes;
-
-    while ((bytes_read = read(STDIN_FILENO, buf, buf_size)) > 0) {
-        parser_feed(p, buf, bytes_read);
+    bool should_exit = false;
 
-        struct command_line* line = NULL;
-        while (true) {
-            enum parser_error err = parser_pop_next(p, &line);
-            if (err == PARSER_ERR_NONE && line == NULL) {
+    size_t map_size = 0;
+    off_t map_offset = 0;
+    void* map = map_stdin(map_size, map_offset);
+    script_cache cache;
+    if (map != MAP_FAILED) {
+        const char* script = (const char*)map + map_offset;
+        size_t script_size = map_size - map_offset;
+        if (!options.is_caching_scripts ||
+            !script_cache_feed(p, script, script_size, cache)) {
+            parser_feed_ref(p, script, script_size);
+        }
+        stdin_script script_file = {map_offset, false};
+        should_exit = execute_parsed_lines(p, last_status, &script_file);
+        while (!should_exit && script_file.is_moved) {
+            /* A command has read a part of the script, skip it. */
+            parser_delete(p);
+            p = parser_new();
+            script_file.is_moved = false;
+            if ((size_t)script_file.offset >= map_size) {
                 break;
             }
-            if (err != PARSER_ERR_NONE) {
-                printf("Error: %d\n", (int)err);
+            parser_feed_ref(p, (const char*)map + script_file.offset,
+                            map_size - script_file.offset);
+            should_exit = execute_parsed_lines(p, last_status, &script_file);
+        }
+        job_table_reap(false);
+        /* The read loop goes on with whatever is appended later. */
+        stdin_line_end = -1;
+        lseek(STDIN_FILENO, map_size, SEEK_SET);
+    }
+
+    /*
+     * Pipes and terminals return what they have, so the reads grow
+     * only while they keep filling the buffer, like when the script
+     * comes from a pipe.
+     */
+    std::vector<char> buf(READ_SIZE_MIN);
+    ssize_t bytes_read;
+    while (!should_exit &&
+           (bytes_read = read(STDIN_FILENO, buf.data(), buf.size())) > 0) {
+        parser_feed(p, buf.data(), bytes_read);
+        should_exit = execute_parsed_lines(p, last_status, nullptr);
+        job_table_reap(false);
+        if ((size_t)bytes_read == buf.size() && buf.size() < READ_SIZE_MAX) {
+            buf.resize(buf.size() * 2);
+        }
+    }
+    if (!should_exit) {
+        execute_input_end(p, last_status);
+    }
+
+    parser_delete(p);
+    if (cache.map != MAP_FAILED) {
+        munmap(cache.map, cache.map_size);
+    }
+    if (map != MAP_FAILED) {
+        munmap(map, map_size);
+    }
+    job_table_drain_queue();
+    return last_status;
+}
+
+/** A script of the --batch mode. */
+struct batch_script {
+    std::string path;
+    std::string text;
+    /** parser_compile() of the text, empty if it couldn't be read. */
+    std::string compiled;
+    pid_t pid = -1;
+    int code = 0;
+};
+
+static bool
+read_file(const std::string& path, std::string& out)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        out.reserve(st.st_size);
+    }
+    char buf[READ_SIZE_MIN];
+    ssize_t rc;
+    while ((rc = read(fd, buf, sizeof(buf))) > 0) {
+        out.append(buf, rc);
+    }
+    close(fd);
+    return rc == 0;
+}
+
+static bool
+name_has_suffix(std::string_view name, std::string_view suffix)
+{
+    return name.size() > suffix.size() && name.substr(name.size() - suffix.size()) == suffix;
+}
+
+/**
+ * The scripts of the batch directory in the name order. Hidden files,
+ * the outputs of the previous runs and the --script-cache files (with
+ * their temporary ones) are skipped.
+ */
+static std::vector<batch_script>
+batch_list(const char* dir_path)
+{
+    std::vector<batch_script> scripts;
+    DIR* dir = opendir(dir_path);
+    if (dir == nullptr) {
+        fprintf(stderr, "%s: %s\n", dir_path, strerror(errno));
+        return scripts;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string_view name = entry->d_name;
+        if (name[0] == '.' || name_has_suffix(name, ".out") || name_has_suffix(name, ".cache") ||
+            name_has_suffix(name, ".tmp")) {
+            continue;
+        }
+        std::string path = std::string(dir_path) + '/' + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            names.push_back(std::move(path));
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    scripts.resize(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        scripts[i].path = std::move(names[i]);
+    }
+    return scripts;
+}
+
+/**
+ * Read and parse the scripts on all the cores. Each thread takes the
+ * next script and parses it with its own parser. It is done before
+ * any script starts, so no thread is running when the shell forks.
+ */
+static void
+batch_parse(std::vector<batch_script>& scripts)
+{
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        for (size_t i = next++; i < scripts.size(); i = next++) {
+            batch_script& script = scripts[i];
+            if (!read_file(script.path, script.text)) {
+                fprintf(stderr, "%s: %s\n", script.path.c_str(), strerror(errno));
                 continue;
             }
+            parser_compile(script.text.data(), script.text.size(), &script.compiled);
+        }
+    };
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = std::min<size_t>(cpu_count > 0 ? cpu_count : 1, scripts.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        try {
+            threads.emplace_back(worker);
+        } catch (const std::system_error& e) {
+            /* The rest is parsed by the ones which have started. */
+            break;
+        }
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+/**
+ * Run the script in a forked shell with the output going into the
+ * file next to it. The child gets the parsed script from the parent
+ * memory, so a script costs a fork instead of a new shell process.
+ */
+static pid_t
+batch_start(const batch_script& script)
+{
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            perror("fork");
+        }
+        return pid;
+    }
+    std::string out_path = script.path + ".out";
+    int out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (out_fd < 0 || in_fd < 0) {
+        fprintf(stderr, "%s: %s\n", out_path.c_str(), strerror(errno));
+        _exit(1);
+    }
+    dup2(in_fd, STDIN_FILENO);
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(out_fd, STDERR_FILENO);
 
-            bool should_exit = process_command_line(line, last_status, bg_processes);
-            delete line;
-            cleanup_background(bg_processes);
-            if (should_exit) {
-                parser_delete(p);
-                return last_status;
+    struct parser* p = parser_new();
+    int last_status = 0;
+    if (parser_feed_compiled(p, script.compiled.data(), script.compiled.size(),
+                             script.text.data(), script.text.size())) {
+        if (!execute_parsed_lines(p, last_status, nullptr)) {
+            execute_input_end(p, last_status);
+        }
+    }
+    job_table_drain_queue();
+    fflush(stdout);
+    _exit(last_status);
+}
+
+/**
+ * --batch mode. All the scripts of the directory are parsed in
+ * parallel and then run, at most one per CPU or --max-jobs at once.
+ * Each script has its own shell state, stdin is /dev/null, and stdout
+ * and stderr go to the script path plus ".out". The failed scripts
+ * are reported, and the shell fails if any of them did.
+ */
+static int
+run_batch(const char* dir_path)
+{
+    std::vector<batch_script> scripts = batch_list(dir_path);
+    batch_parse(scripts);
+
+    std::unordered_map<pid_t, size_t> running;
+    size_t next = 0;
+    int rc = 0;
+    while (next < scripts.size() || !running.empty()) {
+        while (next < scripts.size() &&
+               (options.batch_jobs == 0 || running.size() < (size_t)options.batch_jobs)) {
+            batch_script& script = scripts[next++];
+            if (script.compiled.empty()) {
+                script.code = 1;
+                rc = 1;
+                continue;
+            }
+            script.pid = batch_start(script);
+            if (script.pid < 0) {
+                script.code = 1;
+                rc = 1;
+                continue;
+            }
+            running[script.pid] = &script - scripts.data();
+        }
+        if (running.empty()) {
+            continue;
+        }
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("waitpid");
+            return 1;
+        }
+        auto it = running.find(pid);
+        if (it == running.end()) {
+            continue;
+        }
+        batch_script& script = scripts[it->second];
+        running.erase(it);
+        script.code = status_to_code(status);
+        if (script.code != 0) {
+            fprintf(stderr, "%s: exit code %d\n", script.path.c_str(), script.code);
+            rc = 1;
         }
-        cleanup_background(bg_processes);
     }
+    return rc;
+}
 
-    parser_delete(p);
-    cleanup_background(bg_processes);
-    return last_status;
+static void
+usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [--pipe-size BYTES] [--max-jobs N] [--profile]\n"
+            "       [--script-cache] [--batch DIR]\n", name);
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
-    return run_shell_loop();
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count <= 0) {
+        cpu_count = 1;
+    }
+    options.max_jobs = JOB_DEFAULT_MAX_PER_CPU * cpu_count;
+    /* Batch scripts don't wait for each other, one per CPU is enough. */
+    options.batch_jobs = cpu_count;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--pipe-size") == 0 && i + 1 < argc) {
+            options.pipe_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-jobs") == 0 && i + 1 < argc) {
+            options.max_jobs = atoi(argv[++i]);
+            options.batch_jobs = options.max_jobs;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            options.is_profiling = true;
+        } else if (strcmp(argv[i], "--script-cache") == 0) {
+            options.is_caching_scripts = true;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            options.batch_dir = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    variable_table_init();
+    int rc = options.batch_dir != nullptr ? run_batch(options.batch_dir) : run_shell_loop();
+    if (options.is_profiling) {
+        profile_report();
+    }
+    /* The leak checks run before the static destructors. */
+    job_table_forget();
+    path_cache_free();
+    variable_table_free();
+    output_cache_free();
+    return rc;
 }
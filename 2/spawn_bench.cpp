@@ -0,0 +1,149 @@
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+/*
+ * Pipeline startup benchmark. The process grows its resident set
+ * to the given size, like a shell which has parsed a big script,
+ * and then launches pipelines of `true` with fork() + execvp() and
+ * with posix_spawnp(), waiting for each of them. One JSON object
+ * per line is printed:
+ *
+ *   {"rss_mb":256,"method":"spawn","stages":3,"pipelines":...,
+ *    "us_per_pipeline":...}
+ *
+ * Usage: ./spawn_bench [--count N] [--quick]
+ */
+
+enum {
+	BENCH_STAGES = 3,
+};
+
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *bench_argv[] = {(char *)"true", NULL};
+
+static pid_t
+bench_launch_fork(int in, int out, int unused)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (in != -1) {
+			dup2(in, STDIN_FILENO);
+			close(in);
+		}
+		if (out != -1) {
+			dup2(out, STDOUT_FILENO);
+			close(out);
+			close(unused);
+		}
+		execvp(bench_argv[0], bench_argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+static pid_t
+bench_launch_spawn(int in, int out, int unused)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (in != -1) {
+		posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+		posix_spawn_file_actions_addclose(&actions, in);
+	}
+	if (out != -1) {
+		posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+		posix_spawn_file_actions_addclose(&actions, out);
+		posix_spawn_file_actions_addclose(&actions, unused);
+	}
+	pid_t pid = -1;
+	if (posix_spawnp(&pid, bench_argv[0], &actions, NULL, bench_argv,
+	    environ) != 0)
+		pid = -1;
+	posix_spawn_file_actions_destroy(&actions);
+	return pid;
+}
+
+typedef pid_t (*bench_launch_f)(int in, int out, int unused);
+
+static void
+bench_run_pipeline(bench_launch_f launch)
+{
+	pid_t pids[BENCH_STAGES];
+	int in = -1;
+	for (int i = 0; i < BENCH_STAGES; ++i) {
+		int pipefd[2] = {-1, -1};
+		if (i + 1 < BENCH_STAGES && pipe(pipefd) != 0)
+			abort();
+		pids[i] = launch(in, pipefd[1], pipefd[0]);
+		if (pids[i] < 0)
+			abort();
+		if (in != -1)
+			close(in);
+		if (pipefd[1] != -1)
+			close(pipefd[1]);
+		in = pipefd[0];
+	}
+	for (int i = 0; i < BENCH_STAGES; ++i)
+		waitpid(pids[i], NULL, 0);
+}
+
+static void
+bench_run_one(size_t rss_mb, const char *method, bench_launch_f launch,
+	unsigned count)
+{
+	uint64_t start = bench_now_ns();
+	for (unsigned i = 0; i < count; ++i)
+		bench_run_pipeline(launch);
+	uint64_t duration = bench_now_ns() - start;
+	printf("{\"rss_mb\":%zu,\"method\":\"%s\",\"stages\":%d,"
+		"\"pipelines\":%u,\"us_per_pipeline\":%.1f}\n",
+		rss_mb, method, BENCH_STAGES, count, duration / 1e3 / count);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned count = 200;
+	bool is_quick = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+			count = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--quick") == 0) {
+			is_quick = true;
+		} else {
+			fprintf(stderr, "Usage: %s [--count N] [--quick]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	const size_t sizes[] = {0, 64, 256, 1024};
+	const size_t quick_sizes[] = {0, 64};
+	const size_t *size_list = is_quick ? quick_sizes : sizes;
+	size_t size_count = is_quick ?
+		sizeof(quick_sizes) / sizeof(quick_sizes[0]) :
+		sizeof(sizes) / sizeof(sizes[0]);
+	std::vector<char> ballast;
+	for (size_t i = 0; i < size_count; ++i) {
+		/* Touch the memory, so it is really resident. */
+		ballast.resize(size_list[i] * 1024 * 1024, 1);
+		bench_run_one(size_list[i], "fork", bench_launch_fork, count);
+		bench_run_one(size_list[i], "spawn", bench_launch_spawn, count);
+	}
+	return 0;
+}